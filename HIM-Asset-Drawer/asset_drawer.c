@@ -3,6 +3,9 @@
 #endif
 
 #include "asset_drawer.h"
+#include "him_file.h"
+#include "compressor.h"
+#include "pixel_codec.h"
 
 #include <windows.h>
 
@@ -46,15 +49,8 @@ int hover_py = 0;
 SelectionArea selection = { 0, 0, 0, 0, 0 };
 Clipboard clipboard = { NULL, 0, 0 };
 
-char* rgba_to_hex(Color4* color)
-{
-    char* hex = malloc(11);
-    if (!hex) return NULL;
-
-    sprintf(hex, "0x%02X%02X%02X%02X", color->r, color->g, color->b, color->a);
-
-    return hex;
-}
+// saving happens on the UI thread, so the editor favours speed over ratio
+HimSaveOptions save_options = { HIM_FORMAT_LATEST, 0, LZ_LEVEL_FAST, NULL };
 
 static void apply_canvas_layout(void)
 {
@@ -71,10 +67,28 @@ static void apply_canvas_layout(void)
 
 Color4 hex_to_color(char* hexc)
 {
-    uint32_t hex = (uint32_t)strtoul(hexc, NULL, 0);
-
     Color4 color;
 
+    // "0xRRGGBBAA", the only form the editor writes, skips strtoul
+    char token[PIXEL_HEX_TOKEN];
+    uint8_t rgba[4];
+    size_t used;
+    if (strlen(hexc) == PIXEL_HEX_TOKEN - 1)
+    {
+        memcpy(token, hexc, PIXEL_HEX_TOKEN - 1);
+        token[PIXEL_HEX_TOKEN - 1] = ' ';
+        if (pixel_hex_decode((const uint8_t*)token, PIXEL_HEX_TOKEN, rgba, 1, &used) == 1)
+        {
+            color.r = rgba[0];
+            color.g = rgba[1];
+            color.b = rgba[2];
+            color.a = rgba[3];
+            return color;
+        }
+    }
+
+    uint32_t hex = (uint32_t)strtoul(hexc, NULL, 0);
+
     color.r = (hex >> 24) & 0xFF;
     color.g = (hex >> 16) & 0xFF;
     color.b = (hex >> 8) & 0xFF;
@@ -115,172 +129,72 @@ void init_pixels(Color4** pixels, int width, int height)
             pixels[y][x] = CNULL;
 }
 
-void save_pixels(Color4** pixels, int width, int height, const char* filename)
+static void canvas_read_span(void* user, int x, int y, int count, uint8_t* rgba)
 {
-    size_t plain_cap = (size_t)width * (size_t)height * 11 + (size_t)height + 64;
-    char* plain = (char*)malloc(plain_cap);
-    if (!plain)
-        return;
-
-    size_t pos = 0;
-
-    for (int y = 0; y < height; y++)
-    {
-        for (int x = 0; x < width; x++)
-        {
-            Color4 c = pixels[y][x];
-            int wrote = snprintf(plain + pos, plain_cap - pos, "0x%02X%02X%02X%02X ", c.r, c.g, c.b, c.a);
-            if (wrote <= 0 || pos + (size_t)wrote >= plain_cap)
-            {
-                free(plain);
-                return;
-            }
-            pos += (size_t)wrote;
-        }
-
-        if (pos + 2 >= plain_cap)
-        {
-            free(plain);
-            return;
-        }
+    Color4** pixels = (Color4**)user;
 
-        plain[pos++] = '\n';
-        plain[pos] = '\0';
-    }
-
-    size_t comp_cap = plain_cap * 32 + 1024;
-    char* compressed = (char*)malloc(comp_cap);
-    if (!compressed)
+    for (int i = 0; i < count; i++)
     {
-        free(plain);
-        return;
+        Color4 c = pixels[y][x + i];
+        rgba[i * 4 + 0] = (uint8_t)c.r;
+        rgba[i * 4 + 1] = (uint8_t)c.g;
+        rgba[i * 4 + 2] = (uint8_t)c.b;
+        rgba[i * 4 + 3] = (uint8_t)c.a;
     }
-
-    compressed[0] = '\0';
-    compress_string(plain, compressed);
-
-    FILE* fout = fopen(filename, "wb");
-    if (!fout)
-    {
-        printf("save_pixels: failed to open '%s'\n", filename);
-        free(compressed);
-        free(plain);
-        return;
-    }
-
-    fprintf(fout, "%d %d\n", width, height);
-
-    size_t clen = strlen(compressed);
-    size_t wrote = fwrite(compressed, 1, clen, fout);
-    fclose(fout);
-
-    if (wrote != clen)
-        printf("save_pixels: short write '%s' (%zu/%zu)\n", filename, wrote, clen);
-    else
-        printf("save_pixels: wrote '%s' (%zu bytes payload)\n", filename, clen);
-
-    free(compressed);
-    free(plain);
 }
 
-void load_pixels(Color4*** pixels, int* width, int* height, const char* filename)
+typedef struct
 {
-    FILE* fin = fopen(filename, "rb");
-    if (!fin)
-    {
-        printf("load_pixels: failed to open '%s'\n", filename);
-        return;
-    }
-
-    int file_w = 0;
-    int file_h = 0;
-    if (fscanf(fin, "%d %d", &file_w, &file_h) != 2)
-    {
-        printf("load_pixels: bad header '%s'\n", filename);
-        fclose(fin);
-        return;
-    }
-
-    int ch = fgetc(fin);
-    while (ch != EOF && ch != '\n')
-        ch = fgetc(fin);
-
-    if (*pixels != NULL) {
-        free_pixels(*pixels, *height);
-    }
-
-    *pixels = alloc_pixels(file_w, file_h);
-    if (!*pixels) {
-        printf("load_pixels: failed to allocate memory\n");
-        fclose(fin);
-        return;
-    }
+    Color4*** pixels;
+    int* width;
+    int* height;
+} CanvasTarget;
 
-    init_pixels(*pixels, file_w, file_h);
-
-    fseek(fin, 0, SEEK_END);
-    long end_pos = ftell(fin);
-    fseek(fin, 0, SEEK_SET);
+static int canvas_begin(void* user, int w, int h)
+{
+    CanvasTarget* target = (CanvasTarget*)user;
 
-    fscanf(fin, "%*d %*d");
-    ch = fgetc(fin);
-    while (ch != EOF && ch != '\n')
-        ch = fgetc(fin);
+    Color4** p = alloc_pixels(w, h);
+    if (!p)
+        return 0;
 
-    long payload_start = ftell(fin);
-    size_t payload_len = (size_t)(end_pos - payload_start);
+    init_pixels(p, w, h);
 
-    char* compressed = (char*)malloc(payload_len + 1);
-    if (!compressed)
-    {
-        free_pixels(*pixels, file_h);
-        fclose(fin);
-        return;
-    }
+    if (*target->pixels != NULL)
+        free_pixels(*target->pixels, *target->height);
 
-    size_t r = fread(compressed, 1, payload_len, fin);
-    fclose(fin);
-    compressed[r] = '\0';
-
-    size_t decomp_cap = (size_t)file_w * (size_t)file_h * 11 + (size_t)file_h + 128;
-    char* decompressed = (char*)malloc(decomp_cap);
-    if (!decompressed)
-    {
-        free(compressed);
-        free_pixels(*pixels, file_h);
-        return;
-    }
-
-    decompressed[0] = '\0';
-    decompress_string(compressed, decompressed);
+    *target->pixels = p;
+    *target->width = w;
+    *target->height = h;
+    return 1;
+}
 
-    char* tok = strtok(decompressed, " \t\r\n");
+static void canvas_write_span(void* user, int x, int y, int count, const uint8_t* rgba)
+{
+    CanvasTarget* target = (CanvasTarget*)user;
+    Color4* row = (*target->pixels)[y];
 
-    for (int y = 0; y < file_h; y++)
+    for (int i = 0; i < count; i++)
     {
-        for (int x = 0; x < file_w; x++)
-        {
-            if (!tok)
-            {
-                printf("load_pixels: truncated data '%s'\n", filename);
-                free(decompressed);
-                free(compressed);
-                free_pixels(*pixels, file_h);
-                return;
-            }
-
-            (*pixels)[y][x] = hex_to_color(tok);
-            tok = strtok(NULL, " \t\r\n");
-        }
+        row[x + i].r = rgba[i * 4 + 0];
+        row[x + i].g = rgba[i * 4 + 1];
+        row[x + i].b = rgba[i * 4 + 2];
+        row[x + i].a = rgba[i * 4 + 3];
     }
+}
 
-    *width = file_w;
-    *height = file_h;
-
-    printf("load_pixels: loaded '%s' (%dx%d)\n", filename, file_w, file_h);
+void save_pixels(Color4** pixels, int width, int height, const char* filename)
+{
+    HimSource src = { pixels, canvas_read_span };
+    him_save(filename, width, height, &src, &save_options);
+}
 
-    free(decompressed);
-    free(compressed);
+void load_pixels(Color4*** pixels, int* width, int* height, const char* filename)
+{
+    CanvasTarget target = { pixels, width, height };
+    // Color4 holds ints, so there is no RGBA8 canvas to hand him_load
+    HimSink sink = { &target, canvas_begin, canvas_write_span, NULL };
+    him_load(filename, &sink);
 }
 
 
@@ -538,6 +452,137 @@ Color4** process_command(SDL_Window* window, SDL_Renderer* renderer, Color4** pi
 
         printf("Scale: %d\n", scale);
     }
+    else if (strcmp(tok, "format") == 0)
+    {
+        tok = strtok(NULL, " ");
+
+        if (tok && strcmp(tok, "stream") == 0)
+            save_options.format = HIM_FORMAT_LZ;
+        else if (tok && strcmp(tok, "blocks") == 0)
+            save_options.format = HIM_FORMAT_LZ_BLOCKS;
+        else if (tok && strcmp(tok, "pixels") == 0)
+            save_options.format = HIM_FORMAT_PIXELS;
+        else if (tok && strcmp(tok, "indexed") == 0)
+            save_options.format = HIM_FORMAT_INDEXED;
+        else if (tok && strcmp(tok, "tiles") == 0)
+            save_options.format = HIM_FORMAT_TILES;
+        else if (tok && strcmp(tok, "raw") == 0)
+            save_options.format = HIM_FORMAT_RAW;
+        else if (tok && strcmp(tok, "chunks") == 0)
+            save_options.format = HIM_FORMAT_CHUNKS;
+        else
+        {
+            printf("Usage: format <stream|blocks|pixels|indexed|tiles|raw|chunks>\n");
+            return pixels;
+        }
+
+        printf("Save format: %s\n", tok);
+        if (save_options.dict && save_options.format != HIM_FORMAT_LZ_BLOCKS)
+        {
+            save_options.dict = NULL;
+            printf("Saving without dictionary, only format blocks uses one\n");
+        }
+    }
+    else if (strcmp(tok, "threads") == 0)
+    {
+        tok = strtok(NULL, " ");
+        save_options.threads = tok ? atoi(tok) : 0;
+
+        printf("Save threads: %d (0 = one per CPU)\n", save_options.threads);
+    }
+    else if (strcmp(tok, "level") == 0)
+    {
+        tok = strtok(NULL, " ");
+        int level = tok ? atoi(tok) : 0;
+
+        if (level < LZ_LEVEL_FAST || level > LZ_LEVEL_BEST)
+        {
+            printf("Usage: level <%d-%d>\n", LZ_LEVEL_FAST, LZ_LEVEL_BEST);
+            return pixels;
+        }
+
+        save_options.level = level;
+        printf("Save level: %d\n", save_options.level);
+    }
+    else if (strcmp(tok, "dict") == 0)
+    {
+        tok = strtok(NULL, " ");
+
+        if (tok && strcmp(tok, "off") == 0)
+        {
+            save_options.dict = NULL;
+            printf("Saving without dictionary\n");
+            return pixels;
+        }
+
+        LZDict dict;
+        int ok = 0;
+
+        if (tok && strcmp(tok, "load") == 0)
+        {
+            tok = strtok(NULL, " ");
+            ok = tok && him_dict_load(tok, &dict);
+        }
+        else if (tok && strcmp(tok, "train") == 0)
+        {
+            char* dict_filename = strtok(NULL, " ");
+            const char* files[256];
+            int count = 0;
+
+            while (count < 256 && (tok = strtok(NULL, " ")) != NULL)
+                files[count++] = tok;
+
+            ok = dict_filename && count > 0 && him_dict_train(files, count, LZ_DICT_DEFAULT_SIZE, &dict);
+            if (ok && !him_dict_save(dict_filename, &dict))
+            {
+                him_dict_free(&dict);
+                ok = 0;
+            }
+        }
+        else
+        {
+            printf("Usage: dict <load file.dict|train file.dict a.him b.him ...|off>\n");
+            return pixels;
+        }
+
+        if (!ok)
+            return pixels;
+
+        // Every dictionary stays registered for as long as the editor runs,
+        // so files saved with an earlier one still load.
+        const LZDict* kept = him_find_dict(dict.id);
+        if (kept)
+        {
+            him_dict_free(&dict);
+        }
+        else
+        {
+            LZDict* copy = malloc(sizeof(LZDict));
+            if (!copy)
+            {
+                him_dict_free(&dict);
+                return pixels;
+            }
+
+            *copy = dict;
+            if (!him_register_dict(copy))
+            {
+                printf("Too many dictionaries, at most %d\n", HIM_MAX_DICTS);
+                him_dict_free(copy);
+                free(copy);
+                return pixels;
+            }
+            kept = copy;
+        }
+        save_options.dict = kept;
+
+        printf("Saving with dictionary %08X (%zu bytes)\n", kept->id, kept->size);
+        if (save_options.format != HIM_FORMAT_LZ_BLOCKS)
+        {
+            save_options.format = HIM_FORMAT_LZ_BLOCKS;
+            printf("Save format: blocks\n");
+        }
+    }
     else if (strcmp(tok, "clear") == 0)
     {
         init_pixels(pixels, width, height);
@@ -996,6 +1041,19 @@ int main(int argc, char* argv[])
                 i++;
                 printf("Save file: %s\n", out_filename);
             }
+            else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+                save_options.level = atoi(argv[i + 1]);
+                if (save_options.level < LZ_LEVEL_FAST)
+                    save_options.level = LZ_LEVEL_FAST;
+                if (save_options.level > LZ_LEVEL_BEST)
+                    save_options.level = LZ_LEVEL_BEST;
+                i++;
+                printf("Save level: %d\n", save_options.level);
+            }
+            else if (strcmp(argv[i], "--release") == 0) {
+                save_options.level = LZ_LEVEL_BEST;
+                printf("Save level: %d\n", save_options.level);
+            }
         }
     }
 
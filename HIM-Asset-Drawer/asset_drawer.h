@@ -77,7 +77,6 @@ extern Color4 CRED;
 extern Color4 CNULL;
 extern Color4 BACKGROUND_COLOR;
 
-char* rgba_to_hex(Color4 *color);
 Color4 hex_to_color(char* hexc);
 
 void compute_initial_scale(void);
@@ -87,6 +86,6 @@ void free_pixels(Color4 **pixels, int height);
 void init_pixels(Color4 **pixels, int width, int height);
 
 void save_pixels(Color4 **pixels, int width, int height, const char* filename);
-void load_pixels(Color4 **pixels, int width, int height, const char* filename);
+void load_pixels(Color4 ***pixels, int *width, int *height, const char* filename);
 
 #endif
\ No newline at end of file
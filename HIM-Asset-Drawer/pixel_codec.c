@@ -0,0 +1,776 @@
+#include "pixel_codec.h"
+#include "compressor.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PIXEL_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(PIXEL_X86) && (defined(__GNUC__) || defined(__clang__))
+#define PIXEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PIXEL_TARGET(isa)
+#endif
+
+// Pixels are packed r | g << 8 | b << 16 | a << 24 so that equality is one compare.
+static uint32_t load_pixel(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store_pixel(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint8_t channel(uint32_t v, int c)
+{
+    return (uint8_t)(v >> (c * 8));
+}
+
+static int cache_slot(uint32_t v)
+{
+    return (channel(v, 0) * 3 + channel(v, 1) * 5 + channel(v, 2) * 7 + channel(v, 3) * 11) % PIXEL_CACHE_SIZE;
+}
+
+static int paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+static uint32_t predict(uint32_t left, uint32_t up, uint32_t up_left)
+{
+    uint32_t v = 0;
+    for (int c = 0; c < 4; c++)
+        v |= (uint32_t)paeth(channel(left, c), channel(up, c), channel(up_left, c)) << (c * 8);
+    return v;
+}
+
+size_t pixel_row_bound(int width)
+{
+    // an RGBA op per pixel plus the one-byte run flushes between them, and a long run header
+    return (size_t)width * 6 + 16;
+}
+
+static size_t put_varint(uint8_t* out, size_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static int get_varint(PixelDecoder* dec, size_t* v)
+{
+    size_t result = 0;
+    int shift = 0;
+
+    while (dec->pos < dec->in_len && shift < 63)
+    {
+        uint8_t b = dec->in[dec->pos++];
+        result |= (size_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            *v = result;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+int pixel_encoder_init(PixelEncoder* enc, int width)
+{
+    memset(enc, 0, sizeof(*enc));
+    enc->width = width;
+    enc->up = (uint8_t*)calloc((size_t)width, 4);
+    return enc->up != NULL;
+}
+
+static size_t flush_run(PixelEncoder* enc, uint8_t* out)
+{
+    size_t n = 0;
+
+    if (enc->run_type == PIXEL_RUN_LEFT)
+    {
+        if (enc->run <= PIXEL_SHORT_RUN)
+            out[n++] = (uint8_t)(PIXEL_OP_RUN + enc->run - 1);
+        else
+        {
+            out[n++] = PIXEL_OP_LONG_RUN;
+            n += put_varint(out + n, enc->run - PIXEL_SHORT_RUN - 1);
+        }
+    }
+    else if (enc->run_type == PIXEL_RUN_UP)
+    {
+        if (enc->run <= PIXEL_SHORT_RUN)
+            out[n++] = (uint8_t)(PIXEL_OP_UP_RUN + enc->run - 1);
+        else
+        {
+            out[n++] = PIXEL_OP_LONG_UP_RUN;
+            n += put_varint(out + n, enc->run - PIXEL_SHORT_RUN - 1);
+        }
+    }
+
+    enc->run_type = 0;
+    enc->run = 0;
+    return n;
+}
+
+size_t pixel_encode_row(PixelEncoder* enc, const uint8_t* rgba, uint8_t* out)
+{
+    size_t n = 0;
+
+    for (int x = 0; x < enc->width; x++)
+    {
+        uint32_t px = load_pixel(rgba + (size_t)x * 4);
+        uint32_t up = load_pixel(enc->up + (size_t)x * 4);
+
+        if (enc->run_type == PIXEL_RUN_LEFT && px == enc->prev)
+        {
+            enc->run++;
+            continue;
+        }
+        if (enc->run_type == PIXEL_RUN_UP && px == up)
+        {
+            enc->run++;
+            enc->prev = px;
+            enc->cache[cache_slot(px)] = px;
+            continue;
+        }
+
+        n += flush_run(enc, out + n);
+
+        if (px == enc->prev)
+        {
+            enc->run_type = PIXEL_RUN_LEFT;
+            enc->run = 1;
+            continue;
+        }
+        if (px == up)
+        {
+            enc->run_type = PIXEL_RUN_UP;
+            enc->run = 1;
+            enc->prev = px;
+            enc->cache[cache_slot(px)] = px;
+            continue;
+        }
+
+        int slot = cache_slot(px);
+        if (enc->cache[slot] == px)
+        {
+            out[n++] = (uint8_t)(PIXEL_OP_INDEX | slot);
+            enc->prev = px;
+            continue;
+        }
+        enc->cache[slot] = px;
+        enc->prev = px;
+
+        uint32_t left = x > 0 ? load_pixel(rgba + (size_t)(x - 1) * 4) : up;
+        uint32_t up_left = x > 0 ? load_pixel(enc->up + (size_t)(x - 1) * 4) : up;
+        uint32_t pred = predict(left, up, up_left);
+
+        if (channel(px, 3) == channel(pred, 3))
+        {
+            int dr = (int8_t)(channel(px, 0) - channel(pred, 0));
+            int dg = (int8_t)(channel(px, 1) - channel(pred, 1));
+            int db = (int8_t)(channel(px, 2) - channel(pred, 2));
+            int dr_dg = dr - dg;
+            int db_dg = db - dg;
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                out[n++] = (uint8_t)(PIXEL_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+            }
+            else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+            {
+                out[n++] = (uint8_t)(PIXEL_OP_LUMA | (dg + 32));
+                out[n++] = (uint8_t)(((dr_dg + 8) << 4) | (db_dg + 8));
+            }
+            else
+            {
+                out[n++] = PIXEL_OP_RGB;
+                out[n++] = channel(px, 0);
+                out[n++] = channel(px, 1);
+                out[n++] = channel(px, 2);
+            }
+        }
+        else
+        {
+            out[n++] = PIXEL_OP_RGBA;
+            store_pixel(out + n, px);
+            n += 4;
+        }
+    }
+
+    memcpy(enc->up, rgba, (size_t)enc->width * 4);
+    return n;
+}
+
+size_t pixel_encode_finish(PixelEncoder* enc, uint8_t* out)
+{
+    return flush_run(enc, out);
+}
+
+void pixel_encoder_free(PixelEncoder* enc)
+{
+    free(enc->up);
+    enc->up = NULL;
+}
+
+int pixel_decoder_init(PixelDecoder* dec, int width, const uint8_t* in, size_t in_len)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->width = width;
+    dec->in = in;
+    dec->in_len = in_len;
+    dec->up = (uint8_t*)calloc((size_t)width, 4);
+    return dec->up != NULL;
+}
+
+int pixel_decode_row(PixelDecoder* dec, uint8_t* rgba)
+{
+    for (int x = 0; x < dec->width; x++)
+    {
+        uint32_t up = load_pixel(dec->up + (size_t)x * 4);
+        uint32_t px = 0;
+
+        if (dec->run == 0)
+        {
+            if (dec->pos >= dec->in_len)
+                return 0;
+
+            uint8_t op = dec->in[dec->pos++];
+
+            if (op == PIXEL_OP_RGB || op == PIXEL_OP_RGBA)
+            {
+                size_t len = op == PIXEL_OP_RGB ? 3 : 4;
+                if (dec->in_len - dec->pos < len)
+                    return 0;
+
+                uint32_t left = x > 0 ? load_pixel(rgba + (size_t)(x - 1) * 4) : up;
+                uint32_t up_left = x > 0 ? load_pixel(dec->up + (size_t)(x - 1) * 4) : up;
+                uint32_t alpha = op == PIXEL_OP_RGB ? channel(predict(left, up, up_left), 3) : dec->in[dec->pos + 3];
+
+                px = (uint32_t)dec->in[dec->pos] | ((uint32_t)dec->in[dec->pos + 1] << 8) | ((uint32_t)dec->in[dec->pos + 2] << 16) | (alpha << 24);
+                dec->pos += len;
+            }
+            else if (op >= PIXEL_OP_RUN)
+            {
+                size_t run;
+                if (op == PIXEL_OP_LONG_RUN || op == PIXEL_OP_LONG_UP_RUN)
+                {
+                    if (!get_varint(dec, &run))
+                        return 0;
+                    run += PIXEL_SHORT_RUN + 1;
+                    dec->run_type = op == PIXEL_OP_LONG_RUN ? PIXEL_RUN_LEFT : PIXEL_RUN_UP;
+                }
+                else if (op < PIXEL_OP_UP_RUN)
+                {
+                    run = (size_t)(op - PIXEL_OP_RUN) + 1;
+                    dec->run_type = PIXEL_RUN_LEFT;
+                }
+                else
+                {
+                    run = (size_t)(op - PIXEL_OP_UP_RUN) + 1;
+                    dec->run_type = PIXEL_RUN_UP;
+                }
+                dec->run = run;
+            }
+            else if ((op & 0xC0) == PIXEL_OP_INDEX)
+            {
+                px = dec->cache[op & 0x3F];
+                dec->prev = px;
+                store_pixel(rgba + (size_t)x * 4, px);
+                continue;
+            }
+            else
+            {
+                uint32_t left = x > 0 ? load_pixel(rgba + (size_t)(x - 1) * 4) : up;
+                uint32_t up_left = x > 0 ? load_pixel(dec->up + (size_t)(x - 1) * 4) : up;
+                uint32_t pred = predict(left, up, up_left);
+                int dr, dg, db;
+
+                if ((op & 0xC0) == PIXEL_OP_DIFF)
+                {
+                    dr = ((op >> 4) & 3) - 2;
+                    dg = ((op >> 2) & 3) - 2;
+                    db = (op & 3) - 2;
+                }
+                else
+                {
+                    if (dec->pos >= dec->in_len)
+                        return 0;
+                    uint8_t b = dec->in[dec->pos++];
+                    dg = (op & 0x3F) - 32;
+                    dr = dg + (b >> 4) - 8;
+                    db = dg + (b & 15) - 8;
+                }
+
+                px = (uint32_t)(uint8_t)(channel(pred, 0) + dr)
+                    | ((uint32_t)(uint8_t)(channel(pred, 1) + dg) << 8)
+                    | ((uint32_t)(uint8_t)(channel(pred, 2) + db) << 16)
+                    | ((uint32_t)channel(pred, 3) << 24);
+            }
+
+            if (dec->run == 0)
+            {
+                dec->cache[cache_slot(px)] = px;
+                dec->prev = px;
+                store_pixel(rgba + (size_t)x * 4, px);
+                continue;
+            }
+        }
+
+        // inside a run
+        dec->run--;
+        if (dec->run_type == PIXEL_RUN_LEFT)
+        {
+            px = dec->prev;
+        }
+        else
+        {
+            px = up;
+            dec->prev = px;
+            dec->cache[cache_slot(px)] = px;
+        }
+        store_pixel(rgba + (size_t)x * 4, px);
+    }
+
+    memcpy(dec->up, rgba, (size_t)dec->width * 4);
+    return 1;
+}
+
+void pixel_decoder_free(PixelDecoder* dec)
+{
+    free(dec->up);
+    dec->up = NULL;
+}
+
+void pixel_palette_init(PixelPalette* palette)
+{
+    palette->count = 0;
+    for (int i = 0; i < PIXEL_PALETTE_HASH; i++)
+        palette->slots[i] = -1;
+}
+
+static int palette_slot(const PixelPalette* palette, uint32_t v)
+{
+    uint32_t slot = (v * 2654435761u) >> (32 - PIXEL_PALETTE_HASH_BITS);
+    while (palette->slots[slot] >= 0 && palette->colors[palette->slots[slot]] != v)
+        slot = (slot + 1) & (PIXEL_PALETTE_HASH - 1);
+    return (int)slot;
+}
+
+int pixel_palette_add_row(PixelPalette* palette, const uint8_t* rgba, int width)
+{
+    uint32_t last = 0;
+    int have_last = 0;
+
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t px = load_pixel(rgba + (size_t)x * 4);
+        if (have_last && px == last)
+            continue;
+        last = px;
+        have_last = 1;
+
+        int slot = palette_slot(palette, px);
+        if (palette->slots[slot] >= 0)
+            continue;
+
+        if (palette->count == PIXEL_PALETTE_MAX)
+            return 0;
+
+        palette->colors[palette->count] = px;
+        palette->slots[slot] = (int16_t)palette->count;
+        palette->count++;
+    }
+    return 1;
+}
+
+int pixel_palette_bits(const PixelPalette* palette)
+{
+    if (palette->count <= 2)
+        return 1;
+    if (palette->count <= 4)
+        return 2;
+    if (palette->count <= 16)
+        return 4;
+    return 8;
+}
+
+size_t pixel_packed_row_size(int width, int bits)
+{
+    return ((size_t)width * (size_t)bits + 7) / 8;
+}
+
+void pixel_pack_row(const PixelPalette* palette, const uint8_t* rgba, int width, int bits, uint8_t* packed)
+{
+    int per_byte = 8 / bits;
+    uint32_t last = 0;
+    int last_index = -1;
+
+    memset(packed, 0, pixel_packed_row_size(width, bits));
+
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t px = load_pixel(rgba + (size_t)x * 4);
+        if (last_index < 0 || px != last)
+        {
+            last = px;
+            last_index = palette->slots[palette_slot(palette, px)];
+        }
+
+        int shift = 8 - bits * (x % per_byte + 1);
+        packed[x / per_byte] |= (uint8_t)(last_index << shift);
+    }
+}
+
+void pixel_expander_init(PixelExpander* ex, const uint8_t* colors, int count, int bits)
+{
+    uint8_t table[PIXEL_PALETTE_MAX * 4];
+    memset(table, 0, sizeof(table));
+    memcpy(table, colors, (size_t)count * 4);
+
+    int per_byte = 8 / bits;
+    int mask = (1 << bits) - 1;
+    ex->bits = bits;
+
+    for (int b = 0; b < 256; b++)
+    {
+        for (int k = 0; k < per_byte; k++)
+        {
+            int index = (b >> (8 - bits * (k + 1))) & mask;
+            memcpy(ex->lut + ((size_t)b * per_byte + k) * 4, table + index * 4, 4);
+        }
+    }
+}
+
+void pixel_expand_row(const PixelExpander* ex, const uint8_t* packed, int width, uint8_t* rgba)
+{
+    int per_byte = 8 / ex->bits;
+    size_t stride = (size_t)per_byte * 4;
+    int whole = width / per_byte;
+
+    for (int i = 0; i < whole; i++)
+        memcpy(rgba + (size_t)i * stride, ex->lut + (size_t)packed[i] * stride, stride);
+
+    int rest = width - whole * per_byte;
+    if (rest > 0)
+        memcpy(rgba + (size_t)whole * stride, ex->lut + (size_t)packed[whole] * stride, (size_t)rest * 4);
+}
+
+#define PIXEL_TILES_INITIAL 64
+
+static int is_hex_space(uint8_t c)
+{
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// "0x" or "0X", eight digits checked separately, then a separator
+static int is_hex_frame(const uint8_t* t)
+{
+    return t[0] == '0' && (t[1] | 0x20) == 'x' && is_hex_space(t[PIXEL_HEX_TOKEN - 1]);
+}
+
+// Eight hex digits at once, eight bits per lane of a u64: 0 unless every
+// byte is 0-9, A-F or a-f. The digits land in rgba most significant first.
+static int hex_decode8(const uint8_t* t, uint8_t* rgba)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t high = 0x8080808080808080ull;
+
+    // little-endian, like the rest of the file code
+    uint64_t v;
+    memcpy(&v, t, 8);
+
+    if (v & high)
+        return 0;
+
+    // per lane "x < n" is bit 7 of x + (0x80 - n) being clear, as long as x < 0x80
+    uint64_t d = v ^ (ones * '0');
+    uint64_t a = (v | (ones * 0x20)) ^ (ones * 0x60);
+    uint64_t digit = ~(d + ones * (0x80 - 10)) & high;
+    uint64_t alpha = ~(a + ones * (0x80 - 7)) & (a + ones * (0x80 - 1)) & high;
+    if ((digit | alpha) != high)
+        return 0;
+
+    // '0'-'9' have bit 6 clear, letters have it set and need 9 more
+    uint64_t n = (v & (ones * 0x0F)) + ((v >> 6) & ones) * 9;
+
+    // first digit is in the lowest lane and is the most significant nibble
+    n = ((n & 0x000F000F000F000Full) << 4) | ((n >> 8) & 0x000F000F000F000Full);
+    rgba[0] = (uint8_t)n;
+    rgba[1] = (uint8_t)(n >> 16);
+    rgba[2] = (uint8_t)(n >> 32);
+    rgba[3] = (uint8_t)(n >> 48);
+    return 1;
+}
+
+typedef size_t (*HexDecodeFn)(const uint8_t* text, size_t len, uint8_t* rgba, size_t max_pixels, size_t* used);
+
+static size_t hex_decode_scalar(const uint8_t* text, size_t len, uint8_t* rgba, size_t max_pixels, size_t* used)
+{
+    size_t pos = 0;
+    size_t n = 0;
+
+    while (n < max_pixels)
+    {
+        while (pos < len && is_hex_space(text[pos]))
+            pos++;
+
+        if (len - pos < PIXEL_HEX_TOKEN || !is_hex_frame(text + pos) || !hex_decode8(text + pos + 2, rgba + n * 4))
+            break;
+
+        pos += PIXEL_HEX_TOKEN;
+        n++;
+    }
+
+    *used = pos;
+    return n;
+}
+
+#ifdef PIXEL_X86
+
+// Two tokens back to back per step, one in each 64-bit lane: the digits are
+// checked and turned into nibbles per byte, pmaddubsw joins each pair of
+// nibbles into a byte and packuswb lines up the four bytes of each pixel.
+PIXEL_TARGET("ssse3")
+static size_t hex_decode_ssse3(const uint8_t* text, size_t len, uint8_t* rgba, size_t max_pixels, size_t* used)
+{
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i alpha = _mm_set1_epi8('a');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i five = _mm_set1_epi8(5);
+    const __m128i ten = _mm_set1_epi8(10);
+    const __m128i weights = _mm_set1_epi16(0x0110);
+
+    size_t pos = 0;
+    size_t n = 0;
+
+    while (n < max_pixels)
+    {
+        while (pos < len && is_hex_space(text[pos]))
+            pos++;
+
+        const uint8_t* t = text + pos;
+        if (n + 2 <= max_pixels && len - pos >= 2 * PIXEL_HEX_TOKEN && is_hex_frame(t) && is_hex_frame(t + PIXEL_HEX_TOKEN))
+        {
+            __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(t + 2)), _mm_loadl_epi64((const __m128i*)(t + PIXEL_HEX_TOKEN + 2)));
+
+            // unsigned "x <= n" as min(x, n) == x
+            __m128i d = _mm_sub_epi8(v, zero);
+            __m128i a = _mm_sub_epi8(_mm_or_si128(v, lower), alpha);
+            __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);
+            __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(a, five), a);
+
+            if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) == 0xFFFF)
+            {
+                __m128i nibbles = _mm_or_si128(_mm_and_si128(is_digit, d), _mm_and_si128(is_alpha, _mm_add_epi8(a, ten)));
+                __m128i bytes = _mm_maddubs_epi16(nibbles, weights);
+                _mm_storel_epi64((__m128i*)(rgba + n * 4), _mm_packus_epi16(bytes, bytes));
+
+                pos += 2 * PIXEL_HEX_TOKEN;
+                n += 2;
+                continue;
+            }
+        }
+
+        // a row end, the last odd token or something irregular: one token the scalar way
+        size_t step;
+        size_t got = hex_decode_scalar(t, len - pos, rgba + n * 4, 1, &step);
+        pos += step;
+        if (got == 0)
+            break;
+        n++;
+    }
+
+    *used = pos;
+    return n;
+}
+
+#endif
+
+static HexDecodeFn hex_decode_impl = hex_decode_scalar;
+
+static void pick_hex_decode(void)
+{
+#ifdef PIXEL_X86
+    if (cpu_has_ssse3())
+        hex_decode_impl = hex_decode_ssse3;
+#endif
+}
+
+#ifdef _WIN32
+static INIT_ONCE hex_decode_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK pick_hex_decode_once(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    (void)once;
+    (void)param;
+    (void)context;
+    pick_hex_decode();
+    return TRUE;
+}
+#else
+static pthread_once_t hex_decode_once = PTHREAD_ONCE_INIT;
+#endif
+
+size_t pixel_hex_decode(const uint8_t* text, size_t len, uint8_t* rgba, size_t max_pixels, size_t* used)
+{
+    // loaders call this from parallel_for workers; the kernel is picked exactly once
+#ifdef _WIN32
+    InitOnceExecuteOnce(&hex_decode_once, pick_hex_decode_once, NULL, NULL);
+#else
+    pthread_once(&hex_decode_once, pick_hex_decode);
+#endif
+
+    return hex_decode_impl(text, len, rgba, max_pixels, used);
+}
+
+// "00" "01" ... "FF", two characters per byte value
+#define HEX_PAIRS(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+static const char hex_pairs[] =
+    HEX_PAIRS("0") HEX_PAIRS("1") HEX_PAIRS("2") HEX_PAIRS("3") HEX_PAIRS("4") HEX_PAIRS("5") HEX_PAIRS("6") HEX_PAIRS("7")
+    HEX_PAIRS("8") HEX_PAIRS("9") HEX_PAIRS("A") HEX_PAIRS("B") HEX_PAIRS("C") HEX_PAIRS("D") HEX_PAIRS("E") HEX_PAIRS("F");
+
+void pixel_hex_encode(const uint8_t* rgba, size_t count, uint8_t* text)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t* c = rgba + i * 4;
+        uint8_t* t = text + i * PIXEL_HEX_TOKEN;
+
+        t[0] = '0';
+        t[1] = 'x';
+        memcpy(t + 2, hex_pairs + c[0] * 2, 2);
+        memcpy(t + 4, hex_pairs + c[1] * 2, 2);
+        memcpy(t + 6, hex_pairs + c[2] * 2, 2);
+        memcpy(t + 8, hex_pairs + c[3] * 2, 2);
+        t[10] = ' ';
+    }
+}
+
+static uint32_t tile_hash(const uint8_t* tile)
+{
+    uint32_t h = 0x811C9DC5u;
+    for (int i = 0; i < PIXEL_TILE_BYTES; i += 4)
+    {
+        h = (h ^ load_pixel(tile + i)) * 0x01000193u;
+        h ^= h >> 15;
+    }
+    return h;
+}
+
+static int tile_slot(const PixelTileSet* set, const uint8_t* tile, uint32_t h)
+{
+    uint32_t slot = (h * 2654435761u) & set->slot_mask;
+    for (;;)
+    {
+        int32_t index = set->slots[slot];
+        if (index < 0)
+            return (int)slot;
+        if (set->hashes[index] == h && memcmp(set->tiles + (size_t)index * PIXEL_TILE_BYTES, tile, PIXEL_TILE_BYTES) == 0)
+            return (int)slot;
+        slot = (slot + 1) & set->slot_mask;
+    }
+}
+
+// doubles the tile storage and keeps the hash at most half full
+static int tiles_grow(PixelTileSet* set)
+{
+    int cap = set->cap * 2;
+    uint8_t* tiles = (uint8_t*)realloc(set->tiles, (size_t)cap * PIXEL_TILE_BYTES);
+    if (!tiles)
+        return 0;
+    set->tiles = tiles;
+
+    uint32_t* hashes = (uint32_t*)realloc(set->hashes, (size_t)cap * sizeof(uint32_t));
+    if (!hashes)
+        return 0;
+    set->hashes = hashes;
+
+    int32_t* slots = (int32_t*)malloc((size_t)cap * 2 * sizeof(int32_t));
+    if (!slots)
+        return 0;
+
+    free(set->slots);
+    set->slots = slots;
+    set->slot_mask = (uint32_t)cap * 2 - 1;
+    set->cap = cap;
+
+    for (uint32_t i = 0; i <= set->slot_mask; i++)
+        set->slots[i] = -1;
+    for (int i = 0; i < set->count; i++)
+        set->slots[tile_slot(set, set->tiles + (size_t)i * PIXEL_TILE_BYTES, set->hashes[i])] = i;
+    return 1;
+}
+
+int pixel_tiles_init(PixelTileSet* set)
+{
+    memset(set, 0, sizeof(*set));
+    set->cap = PIXEL_TILES_INITIAL / 2;
+    if (!tiles_grow(set))
+    {
+        pixel_tiles_free(set);
+        return 0;
+    }
+    return 1;
+}
+
+int pixel_tiles_add(PixelTileSet* set, const uint8_t* tile)
+{
+    uint32_t h = tile_hash(tile);
+    int slot = tile_slot(set, tile, h);
+    if (set->slots[slot] >= 0)
+        return set->slots[slot];
+
+    if (set->count == set->cap)
+    {
+        if (!tiles_grow(set))
+            return -1;
+        slot = tile_slot(set, tile, h);
+    }
+
+    int index = set->count++;
+    memcpy(set->tiles + (size_t)index * PIXEL_TILE_BYTES, tile, PIXEL_TILE_BYTES);
+    set->hashes[index] = h;
+    set->slots[slot] = index;
+    return index;
+}
+
+void pixel_tiles_free(PixelTileSet* set)
+{
+    free(set->tiles);
+    free(set->hashes);
+    free(set->slots);
+    set->tiles = NULL;
+    set->hashes = NULL;
+    set->slots = NULL;
+    set->count = 0;
+    set->cap = 0;
+}
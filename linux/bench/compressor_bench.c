@@ -0,0 +1,491 @@
+// Compressor benchmark: runs compress_level and decompress over a corpus at
+// every level, checks the round trips and reports speed, ratio and peak heap.
+//
+//   bin/compressor_bench [-l 1,5,9] [-s max_side] [-r repeats] [-a file.him] [-j out.json|-]
+//
+// The corpus is the shipped spritesheet, sprite canvases from 16x16 up to
+// -s (default 2048, 8192 for the full set; the hex text of 8192x8192 is
+// 738 MB), a noise canvas and a flat fill. Canvases are compressed as the
+// hex text the .him LZ formats store. Exits with 1 when a round trip fails.
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+// Heap use is counted by routing the compressor's allocations through here,
+// so the compressor is built into this file rather than linked.
+static void* bench_malloc(size_t size);
+static void* bench_calloc(size_t count, size_t size);
+static void bench_free(void* ptr);
+
+#define LZ_MALLOC(size) bench_malloc(size)
+#define LZ_CALLOC(count, size) bench_calloc(count, size)
+#define LZ_FREE(ptr) bench_free(ptr)
+#include "../src/compressor.c"
+
+#define BENCH_MAX_ITEMS 16
+#define BENCH_TILE 16
+#define BENCH_TILE_COUNT 32
+#define BENCH_NOISE_SIDE 512
+#define BENCH_FLAT_SIDE 2048
+
+static const int canvas_sides[] = { 16, 64, 256, 1024, 2048, 4096, 8192 };
+
+// one size_t in front of every block, padded so the payload stays 16 byte aligned
+#define BENCH_ALLOC_HEADER 16
+
+static size_t heap_live;
+static size_t heap_peak;
+
+static void* bench_malloc(size_t size)
+{
+    uint8_t* p = (uint8_t*)malloc(size + BENCH_ALLOC_HEADER);
+    if (!p)
+        return NULL;
+
+    *(size_t*)p = size;
+    heap_live += size;
+    if (heap_live > heap_peak)
+        heap_peak = heap_live;
+    return p + BENCH_ALLOC_HEADER;
+}
+
+static void* bench_calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > (size_t)-1 / size)
+        return NULL;
+
+    void* p = bench_malloc(count * size);
+    if (p)
+        memset(p, 0, count * size);
+    return p;
+}
+
+static void bench_free(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    uint8_t* p = (uint8_t*)ptr - BENCH_ALLOC_HEADER;
+    heap_live -= *(size_t*)p;
+    free(p);
+}
+
+static void heap_reset(void)
+{
+    heap_peak = heap_live;
+}
+
+typedef struct
+{
+    char name[64];
+    uint8_t* data;
+    size_t size;
+} BenchItem;
+
+typedef struct
+{
+    const char* item;
+    int level;
+    size_t in_size;
+    size_t out_size;
+    double compress_mbs;
+    double decompress_mbs;
+    size_t compress_peak;
+    size_t decompress_peak;
+    int ok;
+} BenchResult;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// xorshift32, so the corpus is the same on every run and platform
+static uint32_t bench_rand(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static uint8_t* hex_text(const uint8_t* rgba, int width, int height, size_t* size)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    size_t len = ((size_t)width * 11 + 1) * (size_t)height;
+    uint8_t* text = (uint8_t*)malloc(len);
+    if (!text)
+        return NULL;
+
+    uint8_t* p = text;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const uint8_t* c = rgba + ((size_t)y * width + x) * 4;
+            *p++ = '0';
+            *p++ = 'x';
+            for (int i = 0; i < 4; i++)
+            {
+                *p++ = digits[c[i] >> 4];
+                *p++ = digits[c[i] & 15];
+            }
+            *p++ = ' ';
+        }
+        *p++ = '\n';
+    }
+
+    *size = len;
+    return text;
+}
+
+// 16x16 sprites from a small palette: a filled blob with an outline on a
+// transparent background, laid out on the grid the editor draws on.
+static uint8_t* sprite_canvas(int side)
+{
+    static const uint32_t palette[] =
+    {
+        0x000000FF, 0x003300FF, 0x006600FF, 0x228B22FF,
+        0x8B4513FF, 0xA0522DFF, 0xFFD700FF, 0xFF4500FF,
+        0x4682B4FF, 0x87CEEBFF, 0xFFFFFFFF, 0x808080FF,
+    };
+    int colors = (int)(sizeof(palette) / sizeof(palette[0]));
+
+    uint32_t tiles[BENCH_TILE_COUNT][BENCH_TILE * BENCH_TILE];
+    uint32_t state = 0x2545F491u;
+
+    for (int t = 0; t < BENCH_TILE_COUNT; t++)
+    {
+        uint32_t fill = palette[bench_rand(&state) % colors];
+        uint32_t line = palette[bench_rand(&state) % colors];
+        int r = 3 + (int)(bench_rand(&state) % 5);
+
+        for (int y = 0; y < BENCH_TILE; y++)
+        {
+            for (int x = 0; x < BENCH_TILE; x++)
+            {
+                int dx = x - BENCH_TILE / 2;
+                int dy = y - BENCH_TILE / 2;
+                int d = dx * dx + dy * dy;
+                uint32_t c = 0x00000000;
+
+                if (d <= r * r)
+                    c = (d > (r - 1) * (r - 1)) ? line : fill;
+                if (c == fill && bench_rand(&state) % 8 == 0)
+                    c = palette[bench_rand(&state) % colors];
+                tiles[t][y * BENCH_TILE + x] = c;
+            }
+        }
+    }
+
+    uint8_t* rgba = (uint8_t*)malloc((size_t)side * side * 4);
+    if (!rgba)
+        return NULL;
+
+    for (int ty = 0; ty < side; ty += BENCH_TILE)
+    {
+        for (int tx = 0; tx < side; tx += BENCH_TILE)
+        {
+            // about a quarter of the grid stays empty
+            int t = (int)(bench_rand(&state) % (BENCH_TILE_COUNT + BENCH_TILE_COUNT / 3));
+
+            for (int y = ty; y < ty + BENCH_TILE && y < side; y++)
+            {
+                for (int x = tx; x < tx + BENCH_TILE && x < side; x++)
+                {
+                    uint32_t c = t < BENCH_TILE_COUNT ? tiles[t][(y - ty) * BENCH_TILE + (x - tx)] : 0;
+                    uint8_t* p = rgba + ((size_t)y * side + x) * 4;
+                    p[0] = (uint8_t)(c >> 24);
+                    p[1] = (uint8_t)(c >> 16);
+                    p[2] = (uint8_t)(c >> 8);
+                    p[3] = (uint8_t)c;
+                }
+            }
+        }
+    }
+    return rgba;
+}
+
+static uint8_t* noise_canvas(int side)
+{
+    uint32_t state = 0x9E3779B9u;
+    uint8_t* rgba = (uint8_t*)malloc((size_t)side * side * 4);
+    if (!rgba)
+        return NULL;
+
+    for (size_t i = 0; i < (size_t)side * side; i++)
+    {
+        uint32_t c = bench_rand(&state);
+        memcpy(rgba + i * 4, &c, 4);
+    }
+    return rgba;
+}
+
+static uint8_t* flat_canvas(int side)
+{
+    uint8_t* rgba = (uint8_t*)malloc((size_t)side * side * 4);
+    if (!rgba)
+        return NULL;
+
+    for (size_t i = 0; i < (size_t)side * side; i++)
+    {
+        rgba[i * 4 + 0] = 0x22;
+        rgba[i * 4 + 1] = 0x8B;
+        rgba[i * 4 + 2] = 0x22;
+        rgba[i * 4 + 3] = 0xFF;
+    }
+    return rgba;
+}
+
+static int add_canvas(BenchItem* items, int* count, const char* kind, int side, uint8_t* rgba)
+{
+    if (!rgba)
+        return 0;
+
+    BenchItem* item = &items[*count];
+    snprintf(item->name, sizeof(item->name), "%s_%dx%d", kind, side, side);
+    item->data = hex_text(rgba, side, side, &item->size);
+    free(rgba);
+
+    if (!item->data)
+        return 0;
+    (*count)++;
+    return 1;
+}
+
+static int add_file(BenchItem* items, int* count, const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        printf("bench: could not open '%s', skipping it\n", filename);
+        return 1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    BenchItem* item = &items[*count];
+    const char* base = strrchr(filename, '/');
+    snprintf(item->name, sizeof(item->name), "%s", base ? base + 1 : filename);
+    item->size = len > 0 ? (size_t)len : 0;
+    item->data = (uint8_t*)malloc(item->size ? item->size : 1);
+
+    int ok = item->data && fread(item->data, 1, item->size, f) == item->size;
+    fclose(f);
+
+    if (!ok)
+    {
+        printf("bench: could not read '%s'\n", filename);
+        free(item->data);
+        return 0;
+    }
+    (*count)++;
+    return 1;
+}
+
+static void run_item(const BenchItem* item, int level, int repeats, BenchResult* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->item = item->name;
+    r->level = level;
+    r->in_size = item->size;
+
+    size_t cap = compress_bound(item->size);
+    uint8_t* out = (uint8_t*)malloc(cap);
+    uint8_t* back = (uint8_t*)malloc(item->size ? item->size : 1);
+    if (!out || !back)
+    {
+        free(out);
+        free(back);
+        return;
+    }
+
+    double best_c = 0.0;
+    double best_d = 0.0;
+    int ok = 1;
+
+    for (int i = 0; i < repeats && ok; i++)
+    {
+        heap_reset();
+        double t0 = now_seconds();
+        size_t n = compress_level(item->data, item->size, out, cap, level);
+        double t1 = now_seconds();
+        r->compress_peak = heap_peak - heap_live;
+
+        if (n == COMPRESS_ERROR)
+        {
+            ok = 0;
+            break;
+        }
+
+        heap_reset();
+        double t2 = now_seconds();
+        size_t d = decompress(out, n, back, item->size);
+        double t3 = now_seconds();
+        r->decompress_peak = heap_peak - heap_live;
+
+        ok = d == item->size && memcmp(back, item->data, item->size) == 0;
+        r->out_size = n;
+        if (i == 0 || t1 - t0 < best_c)
+            best_c = t1 - t0;
+        if (i == 0 || t3 - t2 < best_d)
+            best_d = t3 - t2;
+    }
+
+    double mb = (double)item->size / (1024.0 * 1024.0);
+    r->compress_mbs = best_c > 0.0 ? mb / best_c : 0.0;
+    r->decompress_mbs = best_d > 0.0 ? mb / best_d : 0.0;
+    r->ok = ok;
+
+    free(out);
+    free(back);
+}
+
+static int write_json(FILE* f, const BenchResult* results, int count)
+{
+    fprintf(f, "{\n  \"results\": [\n");
+    for (int i = 0; i < count; i++)
+    {
+        const BenchResult* r = &results[i];
+        fprintf(f, "    { \"item\": \"%s\", \"level\": %d, \"in_bytes\": %zu, \"out_bytes\": %zu, "
+                   "\"ratio\": %.4f, \"compress_mbs\": %.2f, \"decompress_mbs\": %.2f, "
+                   "\"compress_peak_bytes\": %zu, \"decompress_peak_bytes\": %zu, \"roundtrip\": %s }%s\n",
+                r->item, r->level, r->in_size, r->out_size,
+                r->out_size ? (double)r->in_size / (double)r->out_size : 0.0,
+                r->compress_mbs, r->decompress_mbs, r->compress_peak, r->decompress_peak,
+                r->ok ? "true" : "false", i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return !ferror(f);
+}
+
+static int parse_levels(const char* arg, int* levels)
+{
+    int count = 0;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", arg);
+
+    for (char* tok = strtok(buf, ","); tok && count < LZ_LEVEL_BEST; tok = strtok(NULL, ","))
+    {
+        int level = atoi(tok);
+        if (level < LZ_LEVEL_FAST || level > LZ_LEVEL_BEST)
+            return 0;
+        levels[count++] = level;
+    }
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    int levels[LZ_LEVEL_BEST];
+    int level_count = 0;
+    int max_side = 2048;
+    int repeats = 1;
+    const char* asset = "assets/spritesheet.him";
+    const char* json = NULL;
+
+    for (int level = LZ_LEVEL_FAST; level <= LZ_LEVEL_BEST; level++)
+        levels[level_count++] = level;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+        {
+            level_count = parse_levels(argv[++i], levels);
+            if (level_count == 0)
+            {
+                printf("bench: levels are %d-%d, comma separated\n", LZ_LEVEL_FAST, LZ_LEVEL_BEST);
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            max_side = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            repeats = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+            asset = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            json = argv[++i];
+        else
+        {
+            printf("Usage: %s [-l 1,5,9] [-s max_side] [-r repeats] [-a file.him] [-j out.json|-]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    BenchItem items[BENCH_MAX_ITEMS];
+    int item_count = 0;
+    int ok = add_file(items, &item_count, asset);
+
+    for (int i = 0; ok && i < (int)(sizeof(canvas_sides) / sizeof(canvas_sides[0])); i++)
+    {
+        if (canvas_sides[i] <= max_side)
+            ok = add_canvas(items, &item_count, "sprites", canvas_sides[i], sprite_canvas(canvas_sides[i]));
+    }
+    ok = ok && add_canvas(items, &item_count, "noise", BENCH_NOISE_SIDE, noise_canvas(BENCH_NOISE_SIDE));
+    ok = ok && add_canvas(items, &item_count, "flat", BENCH_FLAT_SIDE, flat_canvas(BENCH_FLAT_SIDE));
+
+    if (!ok)
+    {
+        printf("bench: out of memory building the corpus\n");
+        return 2;
+    }
+
+    int result_count = item_count * level_count;
+    BenchResult* results = (BenchResult*)malloc((size_t)result_count * sizeof(BenchResult));
+    if (!results)
+        return 2;
+
+    // progress goes to stderr so "-j -" leaves stdout as clean JSON
+    FILE* report = (json && strcmp(json, "-") == 0) ? stderr : stdout;
+    fprintf(report, "%-22s %5s %12s %12s %8s %10s %10s %10s %10s  %s\n",
+            "item", "level", "in", "out", "ratio", "comp MB/s", "dec MB/s", "comp KB", "dec KB", "check");
+
+    int failures = 0;
+    for (int i = 0; i < item_count; i++)
+    {
+        for (int l = 0; l < level_count; l++)
+        {
+            BenchResult* r = &results[i * level_count + l];
+            run_item(&items[i], levels[l], repeats, r);
+            failures += !r->ok;
+
+            fprintf(report, "%-22s %5d %12zu %12zu %8.2f %10.1f %10.1f %10zu %10zu  %s\n",
+                    r->item, r->level, r->in_size, r->out_size,
+                    r->out_size ? (double)r->in_size / (double)r->out_size : 0.0,
+                    r->compress_mbs, r->decompress_mbs,
+                    r->compress_peak / 1024, r->decompress_peak / 1024,
+                    r->ok ? "ok" : "FAIL");
+            fflush(report);
+        }
+    }
+
+    if (json)
+    {
+        FILE* f = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+        if (!f || !write_json(f, results, result_count))
+        {
+            printf("bench: could not write '%s'\n", json);
+            failures++;
+        }
+        if (f && f != stdout)
+            fclose(f);
+    }
+
+    fprintf(report, "%d of %d round trips failed\n", failures, result_count);
+
+    for (int i = 0; i < item_count; i++)
+        free(items[i].data);
+    free(results);
+    return failures ? 1 : 0;
+}
@@ -7,6 +7,8 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 
+#include "him_file.h"
+
 #define PALETTE_WIDTH 120
 #define PALETTE_SIZE 32
 
@@ -48,7 +50,6 @@ extern Color4 CRED;
 extern Color4 CNULL;
 extern Color4 BACKGROUND_COLOR;
 
-char* rgba_to_hex(Color4 *color);
 Color4 hex_to_color(char* hexc);
 
 Color4 **alloc_pixels(int width, int height);
@@ -56,6 +57,6 @@ void free_pixels(Color4 **pixels, int height);
 void init_pixels(Color4 **pixels, int width, int height);
 
 void save_pixels(Color4 **pixels, int width, int height, const char* filename);
-void load_pixels(Color4 **pixels, int width, int height, const char* filename);
+int load_pixels(Color4 **pixels, int width, int height, const char* filename);
 
 #endif
\ No newline at end of file
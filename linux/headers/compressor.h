@@ -1,19 +1,107 @@
 #ifndef COMPRESSOR_H
-#define COMRPESSOR_H
+#define COMPRESSOR_H
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define MIN_LZ 3
-#define MAX_LZ 32
+#include <stdint.h>
 
 #define KB(v) ((v) * 1024)
 #define MB(v) ((v) * 1024 * 1024)
 
+// Match lengths of the binary LZ streams; the decoders reject longer ones.
+#define MIN_LZ 3
+#define MAX_LZ MB(1)
+
 #define SEARCH_WINDOW MB(4)
-#define LOOK_AHEAD_WINDOW MB(1)
+#define LOOK_AHEAD_WINDOW MAX_LZ
+
+#define HASH_BITS 16
+#define HASH_CHAIN_DEPTH 128
+#define MATCH_NICE_LENGTH KB(4)
+
+// Binary LZ stream: one header byte with log2 of the encoder window, then
+// groups of a control byte (bit i set = item i is a match, LSB first) and up
+// to eight items. A literal is one raw byte, a match is two LEB128 varints:
+// length - MIN_LZ and offset - 1.
+#define LZ_WINDOW_LOG 22
+
+// When LZ_HEADER_ENTROPY is set in the header byte (compress() only, never
+// the streaming encoder) the items are Huffman coded instead: a varint with
+// the decompressed size, then an LSB-first bit stream holding two canonical
+// code length tables (literal/length and offset, 4 bits per symbol with a
+// run code for unused symbols) and the items. Lengths and offsets are sent as
+// one of HUFF_VALUE_CODES codes plus extra bits, like deflate.
+#define LZ_HEADER_ENTROPY 0x80
+#define LZ_HEADER_WINDOW_MASK 0x1F
+
+#define HUFF_MAX_BITS 12
+#define HUFF_VALUE_CODES 72
+#define HUFF_LITLEN_SYMBOLS (256 + HUFF_VALUE_CODES)
+#define HUFF_OFFSET_SYMBOLS HUFF_VALUE_CODES
+#define HUFF_ZERO_RUN 15
+
+// With LZ_HEADER_DICT set, the header byte is followed by the u32 ID of the
+// dictionary the window was primed with. Matches may reach back past the
+// start of the data into the dictionary, as if it came right before it.
+#define LZ_HEADER_DICT 0x40
+
+#define LZ_DICT_MAX_SIZE KB(256)
+#define LZ_DICT_DEFAULT_SIZE KB(32)
+#define LZ_DICT_SEGMENT 64
+#define LZ_DICT_KMER 8
+#define LZ_DICT_HASH_BITS 20
+
+// returned by compress/decompress when out_cap is too small or the input is corrupt
+#define COMPRESS_ERROR ((size_t)-1)
+
+// control byte + eight matches with 5 byte varints
+#define LZ_MAX_GROUP_SIZE (1 + 8 * 10)
+
+#define LZ_STREAM_WINDOW_LOG 20
+#define LZ_STREAM_LOOKAHEAD KB(64)
+#define LZ_STREAM_OUT_SIZE KB(64)
+#define LZ_STREAM_IN_SIZE KB(64)
+#define LZ_DECODE_CHUNK KB(64)
+
+// room behind a match the decoders may overwrite to copy in whole words
+#define LZ_COPY_SLACK 16
+
+#define MAX_THREADS 64
 
+// Parse strategies, chosen through the compression level:
+// 1-3 greedy, 4-6 lazy (one byte look-ahead), 7-9 price-based optimal.
+// lz_level_params has the full table.
+#define LZ_PARSE_GREEDY 0
+#define LZ_PARSE_LAZY 1
+#define LZ_PARSE_OPTIMAL 2
+
+#define LZ_LEVEL_FAST 1
+#define LZ_LEVEL_DEFAULT 5
+#define LZ_LEVEL_BEST 9
+
+#define LZ_OPT_BLOCK 4096
+#define LZ_OPT_MAX_MATCHES 32
+#define LZ_OPT_ARRAYS 4
+
+// After LZ_OPT_MISS_RUN positions in a row without a match of
+// LZ_OPT_MISS_LENGTH bytes (one hex pixel token and more), the optimal parse
+// walks only LZ_OPT_MISS_DEPTH chain entries per position.
+#define LZ_OPT_MISS_LENGTH 12
+#define LZ_OPT_MISS_RUN 32
+#define LZ_OPT_MISS_DEPTH 8
+
+// Long-distance matching for inputs larger than the regular window. A gear
+// rolling hash over LZ_LDM_MIN_MATCH bytes samples about one position in
+// 2^LZ_LDM_RATE_LOG into a table of at most 2^LZ_LDM_HASH_LOG entries, in
+// buckets of LZ_LDM_BUCKET. A later sample that hits the table becomes a
+// match reaching anywhere up to LZ_LDM_MAX_DISTANCE back. One-shot
+// compressor only; the streaming encoder keeps its window.
+#define LZ_LDM_MIN_MATCH 64
+#define LZ_LDM_RATE_LOG 6
+#define LZ_LDM_HASH_LOG 20
+#define LZ_LDM_BUCKET 4
+#define LZ_LDM_MAX_DISTANCE ((size_t)1 << 30)
 
 typedef struct
 {
@@ -21,12 +109,200 @@ typedef struct
     int offset;
 } Pair;
 
+// Hash chains over MIN_LZ byte prefixes. head[] holds the newest position
+// for every hash, prev[] links each position to the previous one with the
+// same hash. Positions are stored +1 so that 0 means "empty".
+typedef struct
+{
+    uint32_t* head;
+    uint32_t* prev;
+    size_t window_size;
+    size_t window_mask;
+    int chain_depth;
+    size_t nice_length; // stop walking the chain at a match this long
+} MatchFinder;
+
+// Everything a compression level decides. window_log is capped at
+// LZ_WINDOW_LOG, min_match may not go below MIN_LZ nor max_match above MAX_LZ.
+// A match of nice_length ends the chain walk, and in the optimal parse it is
+// taken as found instead of priced.
+typedef struct
+{
+    int window_log;
+    int chain_depth;
+    int min_match;
+    int max_match;
+    int nice_length;
+    int parse;
+    int long_distance;
+} LZParams;
+
+typedef struct
+{
+    uint8_t* out;
+    size_t cap;
+    size_t len;
+    size_t ctrl_pos;
+    int ctrl_bit;
+} TokenWriter;
+
+// id is lz_dict_id() of the contents, so a file names its dictionary exactly
+typedef struct
+{
+    uint32_t id;
+    const uint8_t* data;
+    size_t size;
+} LZDict;
+
+// Caller supplied memory for LZContext; alloc returns NULL on failure.
+typedef struct
+{
+    void* (*alloc)(void* user, size_t size);
+    void (*free)(void* user, void* ptr);
+    void* user;
+} LZAllocator;
+
+// position + 1 (0 = empty) and 32 more bits of the rolling hash
+typedef struct
+{
+    uint32_t pos;
+    uint32_t check;
+} LZLdmEntry;
+
+// Reusable one-shot compressor: owns the hash tables, the dictionary-primed
+// input window, the optimal parse arrays, the long-distance table and the
+// entropy stage scratch. Buffers grow to the largest input seen and are
+// reused, so a run of similar inputs allocates nothing after the first
+// call. params may be changed between calls.
+typedef struct
+{
+    LZAllocator allocator;
+    LZParams params;
+    MatchFinder mf;
+    size_t ring_cap;
+    uint8_t* window;
+    size_t window_cap;
+    uint32_t* opt;
+    uint8_t* scratch;
+    size_t scratch_cap;
+    LZLdmEntry* ldm;
+    size_t ldm_cap;
+    uint64_t gear[256];
+} LZContext;
+
+typedef size_t (*LZWriteFn)(void* user, const uint8_t* data, size_t len);
+
+// Streaming encoder: input is copied into a sliding window buffer of
+// 2 * window + look-ahead bytes and encoded as soon as a full look-ahead is
+// available, output goes out through write() in LZ_STREAM_OUT_SIZE chunks.
+// Produces the same stream format as compress().
+typedef struct
+{
+    uint8_t* buffer;
+    size_t buffer_cap;
+    size_t window_size;
+    size_t pos;
+    size_t end;
+    MatchFinder mf;
+    TokenWriter tw;
+    LZWriteFn write;
+    void* user;
+    size_t total_out;
+    int error;
+} LZStream;
+
+typedef size_t (*LZReadFn)(void* user, uint8_t* data, size_t len);
+typedef int (*LZSinkFn)(void* user, const uint8_t* data, size_t len);
+
+// Streaming decoder: compressed bytes are pulled through read() and decoded
+// into a history of one window plus LZ_DECODE_CHUNK bytes; every time it
+// fills up, the new bytes are handed to the sink and the history slides.
+typedef struct
+{
+    LZReadFn read;
+    void* read_user;
+    uint8_t* in;
+    size_t in_len;
+    size_t in_pos;
+    int in_eof;
+    uint8_t* history;
+    size_t history_cap;
+    size_t window_size;
+    size_t hist_len;
+    size_t flushed;
+    size_t total;
+} LZDecoder;
+
 void char_to_bits(char c, int bits[8]);
 
 void char_to_binary_string(unsigned char c, char bits[9]);
 
-Pair find_longest_match(char* buffer, int pos, int window_size, int max_look_ahead);
+Pair find_longest_match(const char* buffer, int buffer_len, int pos, int window_size, int max_look_ahead);
+
+// chain_depth <= 0 walks the whole chain, so matches are as long as the linear scan's
+int match_finder_init(MatchFinder* mf, size_t window_size, int chain_depth);
+void match_finder_free(MatchFinder* mf);
+void match_finder_insert(MatchFinder* mf, const unsigned char* buffer, size_t buffer_len, size_t pos);
+Pair match_finder_find(MatchFinder* mf, const unsigned char* buffer, size_t buffer_len, size_t pos, size_t max_look_ahead);
+// every match along the chain that is longer than the ones before it, shortest first
+int match_finder_find_all(MatchFinder* mf, const unsigned char* buffer, size_t buffer_len, size_t pos, size_t max_look_ahead, Pair* matches, int max_matches);
+
 void compress_string(char* buffer, char* compressed_buffer);
 void decompress_string(char* compressed, char* decompressed);
+// Decodes compress_string output of len bytes straight to sink in
+// LZ_DECODE_CHUNK pieces, keeping only SEARCH_WINDOW of history. Stops at
+// the first bad token like decompress_string; COMPRESS_ERROR when sink fails.
+size_t decompress_string_stream(const char* compressed, size_t len, LZSinkFn sink, void* user);
+
+// enough for compress_dict at any level, with or without a dictionary
+size_t compress_bound(size_t in_len);
+size_t compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap);
+size_t compress_level(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, int level);
+// levels outside LZ_LEVEL_FAST..LZ_LEVEL_BEST are clamped
+void lz_level_params(int level, LZParams* params);
+// bytes of out past the returned length, up to out_cap, may be overwritten
+size_t decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap);
+
+// dict may be NULL; decompress_dict fails unless it gets the dictionary the stream names
+size_t compress_dict(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, int level, const LZDict* dict);
+size_t compress_params(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, const LZParams* params, const LZDict* dict);
+size_t decompress_dict(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, const LZDict* dict);
+// 0 when the stream was compressed without a dictionary
+uint32_t lz_stream_dict_id(const uint8_t* in, size_t in_len);
+
+// allocator may be NULL for malloc / free; nothing is allocated until the first call
+void lz_context_init(LZContext* ctx, int level, const LZAllocator* allocator);
+size_t lz_context_compress(LZContext* ctx, const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, const LZDict* dict);
+void lz_context_free(LZContext* ctx);
+
+uint32_t lz_dict_id(const uint8_t* data, size_t size);
+void lz_dict_init(LZDict* dict, const uint8_t* data, size_t size);
+// samples are stored back to back; returns the dictionary size, 0 on failure
+size_t lz_dict_train(const uint8_t* samples, const size_t* sample_sizes, int count, uint8_t* dict, size_t dict_cap);
+
+// lz_write_file is an LZWriteFn for a FILE* user pointer
+size_t lz_write_file(void* user, const uint8_t* data, size_t len);
+int lz_stream_init(LZStream* s, int window_log, LZWriteFn write, void* user);
+int lz_stream_feed(LZStream* s, const uint8_t* data, size_t len);
+size_t lz_stream_finish(LZStream* s);
+
+// lz_read_file is an LZReadFn for a FILE* user pointer
+size_t lz_read_file(void* user, uint8_t* data, size_t len);
+int lz_decoder_init(LZDecoder* d, LZReadFn read, void* user);
+size_t lz_decoder_run(LZDecoder* d, LZSinkFn sink, void* user);
+void lz_decoder_free(LZDecoder* d);
+
+// for the SIMD kernels outside the compressor; 0 off x86
+int cpu_has_ssse3(void);
+
+// Runs fn(ctx, i) for i in [0, count) on up to `threads` threads (<= 0: one per CPU).
+// Indices are dealt out round-robin, so fn must not depend on the order.
+int cpu_count(void);
+void parallel_for(int count, int threads, void (*fn)(void* ctx, int index), void* ctx);
+// The same with the worker running each index, in [0, parallel_workers(count, threads)).
+// A worker runs its indices one at a time, so per-worker state (an LZContext,
+// scratch buffers) needs no locking.
+int parallel_workers(int count, int threads);
+void parallel_for_workers(int count, int threads, void (*fn)(void* ctx, int index, int worker), void* ctx);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+#ifndef HIM_FILE_H
+#define HIM_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "compressor.h"
+
+// .him files start with a HIM_HEADER_SIZE binary header, all integers
+// little-endian:
+//
+//   0   4  HIM_MAGIC
+//   4   2  version, HIM_VERSION
+//   6   2  header size, the payload starts here
+//   8   4  width
+//   12  4  height
+//   16  1  pixel format, HIM_PIXEL_RGBA8
+//   17  1  codec, one of the HIM_FORMAT_* numbers below
+//   18  2  reserved, 0
+//   20  8  uncompressed size, width * height * 4
+//   28  8  payload size
+//   36  4  reserved, 0
+//
+// Older files start with a text header "<width> <height>\n" instead and are
+// still loaded. The payload is either the Windows builds' ASCII-LZ
+// (compress_string) text or the Linux builds' plain hex text, told apart by
+// its first token; a text header with anything after the height is refused.
+#define HIM_MAGIC "\x89HIM"
+#define HIM_VERSION 2
+#define HIM_HEADER_SIZE 40
+#define HIM_PIXEL_RGBA8 1
+
+#define HIM_FORMAT_HEX 0 // text header only, never written
+#define HIM_FORMAT_ASCII_LZ 1 // text header only, never written
+#define HIM_FORMAT_LZ 2
+#define HIM_FORMAT_LZ_BLOCKS 3
+#define HIM_FORMAT_PIXELS 4
+#define HIM_FORMAT_INDEXED 5
+#define HIM_FORMAT_TILES 6
+#define HIM_FORMAT_RAW 7
+#define HIM_FORMAT_CHUNKS 8
+
+// indexed when the canvas has few enough colours, otherwise pixels
+#define HIM_FORMAT_LATEST HIM_FORMAT_INDEXED
+
+// HIM_FORMAT_LZ_BLOCKS splits the rows into bands of a multiple of
+// HIM_BLOCK_ROWS (one GRID_SIZE row of tiles), sized to roughly
+// HIM_BLOCK_TARGET bytes of hex text, and compresses each band on its own.
+// The payload is: u32 block count, u32 rows per block, then one
+// HIM_BLOCK_ENTRY_SIZE entry per block (u64 offset past the table, u32
+// length), then the blocks. All integers are little-endian.
+#define HIM_BLOCK_ROWS 16
+#define HIM_BLOCK_TARGET (256 * 1024)
+#define HIM_BLOCK_ENTRY_SIZE 12
+
+// HIM_FORMAT_PIXELS skips the hex text: the payload is the pixel_codec.h
+// stream of all rows, top to bottom.
+
+// HIM_FORMAT_INDEXED, for canvases of at most PIXEL_PALETTE_MAX colours:
+// u16 colour count, the colours as RGBA8, u8 bits per index (1, 2, 4 or 8),
+// then compress() output of all packed index rows. A save asking for it
+// falls back to HIM_FORMAT_PIXELS when there are too many colours.
+
+// HIM_FORMAT_TILES, for tilesets: the canvas is cut into PIXEL_TILE_SIZE
+// tiles (edge tiles padded with 0x00000000) and every distinct tile is kept
+// once. The payload is u32 tile count, then compress() output of the tile
+// map (one index per tile, row by row, u16 when there are at most 65536
+// tiles and u32 otherwise) followed by the tiles as RGBA8, row by row.
+
+// HIM_FORMAT_RAW is the pixels as RGBA8, row by row, uncompressed.
+
+// HIM_FORMAT_CHUNKS, for large maps read a piece at a time: the canvas is cut
+// into square chunks of HIM_CHUNK_SIZE (a multiple of GRID_SIZE), row by row,
+// edge chunks cropped to the canvas, and each chunk's RGBA8 rows are
+// compressed on their own. The payload is laid out like HIM_FORMAT_LZ_BLOCKS
+// with the chunk size in place of the rows per block: u32 chunk count, u32
+// chunk size, one HIM_BLOCK_ENTRY_SIZE entry per chunk, then the chunks.
+// Readers accept any multiple of HIM_BLOCK_ROWS up to HIM_CHUNK_SIZE_MAX.
+#define HIM_CHUNK_SIZE 256
+#define HIM_CHUNK_SIZE_MAX 4096
+
+// Pixels cross this interface as RGBA8 spans (4 bytes per pixel) so the
+// file code does not depend on the editor's Color4 or on SDL.
+typedef struct
+{
+    void* user;
+    void (*read_span)(void* user, int x, int y, int count, uint8_t* rgba);
+} HimSource;
+
+// write_span may be called from several threads at once, but never for the same row.
+typedef struct
+{
+    void* user;
+    int (*begin)(void* user, int width, int height);
+    void (*write_span)(void* user, int x, int y, int count, const uint8_t* rgba);
+    // optional: the canvas as width * height RGBA8 pixels, row by row, once
+    // begin succeeded. Raw files are copied straight into it; without it
+    // (the editors' Color4 canvases) raw rows go through write_span.
+    uint8_t* (*pixels)(void* user);
+} HimSink;
+
+typedef struct
+{
+    int format;
+    int threads;
+    int level; // LZ_LEVEL_FAST..LZ_LEVEL_BEST, block and indexed formats
+    const LZDict* dict; // primes every block and picks HIM_FORMAT_LZ_BLOCKS; loading needs it registered
+} HimSaveOptions;
+
+// A whole .him file in memory, mapped copy-on-write when the platform allows.
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+    int mapped;
+} HimMapping;
+
+// An image as width * height RGBA8 pixels, row by row. For HIM_FORMAT_RAW
+// files pixels points into the file mapping: opening costs no copy, the
+// pages are shared with every other process reading the file, and writes
+// only ever touch private copies. Other formats are decoded into the heap.
+typedef struct
+{
+    int width;
+    int height;
+    uint8_t* pixels;
+    HimMapping map;
+} HimPixels;
+
+// A rectangle of the image, inside its bounds.
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+} HimRegion;
+
+// options may be NULL: HIM_FORMAT_LATEST, one thread per CPU, LZ_LEVEL_DEFAULT.
+// Saves write as they go and hold a row, or one compressed block or chunk
+// per worker, at a time. The exceptions are indexed and tiles saves, which
+// compress their whole index plane (width * height * bits / 8 bytes) or tile
+// set at once and so hold it and its compressed copy in memory.
+int him_save(const char* filename, int width, int height, const HimSource* src, const HimSaveOptions* options);
+// decodes straight from a mapping of the file
+int him_load(const char* filename, const HimSink* sink);
+// begin gets the region's size and spans are relative to it. Chunked and raw
+// files only decode what the region covers, other formats decode in full and
+// crop. region NULL is the whole image.
+int him_load_region(const char* filename, const HimRegion* region, const HimSink* sink);
+// size and HIM_FORMAT_* of a file, from its header alone
+int him_info(const char* filename, int* width, int* height, int* format);
+
+int him_open_pixels(const char* filename, HimPixels* image);
+// a region is always decoded into the heap
+int him_open_region(const char* filename, const HimRegion* region, HimPixels* image);
+void him_close_pixels(HimPixels* image);
+
+// Dictionary files: "HIMD", u32 id, u32 size, then the dictionary bytes.
+#define HIM_DICT_MAGIC "HIMD"
+#define HIM_MAX_DICTS 16
+
+// Trains a dictionary from the hex text of existing .him files; free with him_dict_free.
+int him_dict_train(const char* const* filenames, int count, size_t dict_size, LZDict* dict);
+int him_dict_save(const char* filename, const LZDict* dict);
+int him_dict_load(const char* filename, LZDict* dict);
+void him_dict_free(LZDict* dict);
+
+// him_load finds the dictionaries files were saved with here; the dictionary must outlive the registration
+int him_register_dict(const LZDict* dict);
+const LZDict* him_find_dict(uint32_t id);
+
+#endif
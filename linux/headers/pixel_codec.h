@@ -0,0 +1,146 @@
+#ifndef PIXEL_CODEC_H
+#define PIXEL_CODEC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// QOI-style codec on RGBA8 rows, one op per pixel or run, in scan order.
+// Each pixel is predicted per channel with paeth(left, up, up-left); pixels
+// above the first row are 0x00000000 and the first column uses the pixel
+// above as its left neighbour. A 64 entry cache holds recently seen colours.
+//
+//   00iiiiii          cache[i]
+//   01rrggbb          prediction + (r-2, g-2, b-2), alpha as predicted
+//   10gggggg rrrrbbbb prediction + (g-32, g+r-8, g+b-8), alpha as predicted
+//   11nnnnnn          n < 30: repeat the previous pixel n+1 times
+//                     30 <= n < 60: copy the pixels above, n-29 of them
+//   0xFC varint       repeat the previous pixel varint+31 times
+//   0xFD varint       copy the pixels above, varint+31 of them
+//   0xFE r g b        alpha as predicted
+//   0xFF r g b a
+//
+// Runs continue across row ends.
+#define PIXEL_OP_INDEX 0x00
+#define PIXEL_OP_DIFF 0x40
+#define PIXEL_OP_LUMA 0x80
+#define PIXEL_OP_RUN 0xC0
+#define PIXEL_OP_UP_RUN (PIXEL_OP_RUN + PIXEL_SHORT_RUN)
+#define PIXEL_OP_LONG_RUN 0xFC
+#define PIXEL_OP_LONG_UP_RUN 0xFD
+#define PIXEL_OP_RGB 0xFE
+#define PIXEL_OP_RGBA 0xFF
+
+#define PIXEL_SHORT_RUN 30
+#define PIXEL_CACHE_SIZE 64
+
+#define PIXEL_RUN_LEFT 1
+#define PIXEL_RUN_UP 2
+
+typedef struct
+{
+    int width;
+    uint8_t* up;
+    uint32_t prev;
+    uint32_t cache[PIXEL_CACHE_SIZE];
+    int run_type;
+    size_t run;
+} PixelEncoder;
+
+typedef struct
+{
+    int width;
+    uint8_t* up;
+    uint32_t prev;
+    uint32_t cache[PIXEL_CACHE_SIZE];
+    int run_type;
+    size_t run;
+    const uint8_t* in;
+    size_t in_len;
+    size_t pos;
+} PixelDecoder;
+
+// Palettes for indexed images: up to PIXEL_PALETTE_MAX colours, found
+// through a small open-addressing hash, and rows of 1, 2, 4 or 8 bit
+// indices, first pixel in the high bits, each row padded to a whole byte.
+#define PIXEL_PALETTE_MAX 256
+#define PIXEL_PALETTE_HASH_BITS 10
+#define PIXEL_PALETTE_HASH (1 << PIXEL_PALETTE_HASH_BITS)
+
+typedef struct
+{
+    int count;
+    uint32_t colors[PIXEL_PALETTE_MAX];
+    int16_t slots[PIXEL_PALETTE_HASH];
+} PixelPalette;
+
+// One lookup per packed byte: every byte value maps to the RGBA8 of the 8 / bits pixels it holds.
+typedef struct
+{
+    int bits;
+    uint8_t lut[256 * 8 * 4];
+} PixelExpander;
+
+// Tile deduplication: square RGBA8 tiles of PIXEL_TILE_SIZE (the editor's
+// GRID_SIZE), stored once each and found again through an open-addressing
+// hash of their contents. Tile i is at tiles + i * PIXEL_TILE_BYTES.
+#define PIXEL_TILE_SIZE 16
+#define PIXEL_TILE_BYTES (PIXEL_TILE_SIZE * PIXEL_TILE_SIZE * 4)
+
+typedef struct
+{
+    int count;
+    int cap;
+    uint8_t* tiles;
+    uint32_t* hashes;
+    int32_t* slots;
+    uint32_t slot_mask;
+} PixelTileSet;
+
+// Hex text, the payload of the older .him formats: one "0xRRGGBBAA" token
+// per pixel, tokens separated by whitespace. PIXEL_HEX_TOKEN counts one
+// separator.
+#define PIXEL_HEX_TOKEN 11
+
+// worst case output of one pixel_encode_row call, including a flushed run
+size_t pixel_row_bound(int width);
+
+int pixel_encoder_init(PixelEncoder* enc, int width);
+// both return the number of bytes written, 0 when the op is still pending
+size_t pixel_encode_row(PixelEncoder* enc, const uint8_t* rgba, uint8_t* out);
+size_t pixel_encode_finish(PixelEncoder* enc, uint8_t* out);
+void pixel_encoder_free(PixelEncoder* enc);
+
+int pixel_decoder_init(PixelDecoder* dec, int width, const uint8_t* in, size_t in_len);
+// 0 when the data is corrupt or runs out
+int pixel_decode_row(PixelDecoder* dec, uint8_t* rgba);
+void pixel_decoder_free(PixelDecoder* dec);
+
+void pixel_palette_init(PixelPalette* palette);
+// 0 once the row brings the palette past PIXEL_PALETTE_MAX colours
+int pixel_palette_add_row(PixelPalette* palette, const uint8_t* rgba, int width);
+int pixel_palette_bits(const PixelPalette* palette);
+size_t pixel_packed_row_size(int width, int bits);
+void pixel_pack_row(const PixelPalette* palette, const uint8_t* rgba, int width, int bits, uint8_t* packed);
+
+// colors holds count RGBA8 entries; indices past count expand to 0x00000000
+void pixel_expander_init(PixelExpander* ex, const uint8_t* colors, int count, int bits);
+void pixel_expand_row(const PixelExpander* ex, const uint8_t* packed, int width, uint8_t* rgba);
+
+// Decodes up to max_pixels whole tokens, each followed by whitespace, into
+// RGBA8, skipping whitespace between them. Stops early at anything else;
+// *used gets the bytes consumed, which may include whitespace past the last
+// token. Hex digits are read eight to a 64-bit lane, two tokens per SSSE3
+// register where the CPU has it.
+size_t pixel_hex_decode(const uint8_t* text, size_t len, uint8_t* rgba, size_t max_pixels, size_t* used);
+// Writes count tokens as "0xRRGGBBAA ", upper case, count * PIXEL_HEX_TOKEN
+// bytes and no terminator. Safe from any thread.
+void pixel_hex_encode(const uint8_t* rgba, size_t count, uint8_t* text);
+
+int pixel_tiles_init(PixelTileSet* set);
+// index of the tile, added when it is new; -1 when out of memory
+int pixel_tiles_add(PixelTileSet* set, const uint8_t* tile);
+void pixel_tiles_free(PixelTileSet* set);
+
+#endif
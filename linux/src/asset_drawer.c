@@ -1,4 +1,5 @@
 #include "asset_drawer.h"
+#include "pixel_codec.h"
 
 SDL_Color BLACK = {0, 0, 0, 255};
 SDL_Color WHITE = {255, 255, 255, 255};
@@ -18,22 +19,32 @@ int initial_scale = 10;
 int zoom_offset_x = 0;
 int zoom_offset_y = 0;
 
-char* rgba_to_hex(Color4 *color)
-{
-    char *hex = malloc(11);
-    if (!hex) return NULL;
-
-    sprintf(hex, "0x%02X%02X%02X%02X", color->r, color->g, color->b, color->a);
-
-    return hex;
-}
+HimSaveOptions save_options = {HIM_FORMAT_LATEST, 0, LZ_LEVEL_FAST, NULL};
 
 Color4 hex_to_color(char* hexc)
 {
-    uint32_t hex = (uint32_t) strtoul(hexc, NULL, 0);
-    
     Color4 color;
 
+    // "0xRRGGBBAA", the only form the editor writes, skips strtoul
+    char token[PIXEL_HEX_TOKEN];
+    uint8_t rgba[4];
+    size_t used;
+    if (strlen(hexc) == PIXEL_HEX_TOKEN - 1)
+    {
+        memcpy(token, hexc, PIXEL_HEX_TOKEN - 1);
+        token[PIXEL_HEX_TOKEN - 1] = ' ';
+        if (pixel_hex_decode((const uint8_t*)token, PIXEL_HEX_TOKEN, rgba, 1, &used) == 1)
+        {
+            color.r = rgba[0];
+            color.g = rgba[1];
+            color.b = rgba[2];
+            color.a = rgba[3];
+            return color;
+        }
+    }
+
+    uint32_t hex = (uint32_t)strtoul(hexc, NULL, 0);
+
     color.r = (hex >> 24) & 0xFF;
     color.g = (hex >> 16) & 0xFF;
     color.b = (hex >> 8) & 0xFF;
@@ -69,56 +80,65 @@ void init_pixels(Color4 **pixels, int width, int height)
             pixels[y][x] = CNULL;
 }
 
-void save_pixels(Color4 **pixels, int width, int height, const char* filename)
+static void canvas_read_span(void* user, int x, int y, int count, uint8_t* rgba)
 {
-    FILE *fout = fopen(filename, "w");
-    if (!fout) return;
-
-    fprintf(fout, "%d %d\n", width, height);
+    Color4 **pixels = (Color4 **)user;
 
-    for (int y = 0; y < height; y++)
+    for (int i = 0; i < count; i++)
     {
-        for (int x = 0; x < width; x++)
-        {
-            char *hex = rgba_to_hex(&pixels[y][x]);
-            fprintf(fout, "%s ", hex);
-            free(hex);
-        }
-        fprintf(fout, "\n");
+        Color4 c = pixels[y][x + i];
+        rgba[i * 4 + 0] = (uint8_t)c.r;
+        rgba[i * 4 + 1] = (uint8_t)c.g;
+        rgba[i * 4 + 2] = (uint8_t)c.b;
+        rgba[i * 4 + 3] = (uint8_t)c.a;
     }
-    fclose(fout);
 }
 
-void load_pixels(Color4 **pixels, int width, int height, const char* filename)
+typedef struct
 {
-    FILE *fin = fopen(filename, "r");
-    if (!fin) return;
+    Color4 **pixels;
+    int width;
+    int height;
+} CanvasTarget;
 
-    int w, h;
-    if (fscanf(fin, "%d %d", &w, &h) != 2)
-    {
-        fclose(fin);
-        return;
-    }
+static int canvas_begin(void* user, int w, int h)
+{
+    CanvasTarget *target = (CanvasTarget *)user;
 
-    if (w != width || h != height)
+    if (w != target->width || h != target->height)
     {
-        printf("Size mismatch: file %dx%d, expected %dx%d\n", w, h, width, height);
-        fclose(fin);
-        return;
+        printf("Size mismatch: file %dx%d, expected %dx%d\n", w, h, target->width, target->height);
+        return 0;
     }
+    return 1;
+}
 
-    char color_str[11];
-    for (int y = 0; y < height; y++)
+static void canvas_write_span(void* user, int x, int y, int count, const uint8_t* rgba)
+{
+    CanvasTarget *target = (CanvasTarget *)user;
+    Color4 *row = target->pixels[y];
+
+    for (int i = 0; i < count; i++)
     {
-        for (int x = 0; x < width; x++)
-        {
-            fscanf(fin, "%10s", color_str);
-            pixels[y][x] = hex_to_color(color_str);
-        }
+        row[x + i].r = rgba[i * 4 + 0];
+        row[x + i].g = rgba[i * 4 + 1];
+        row[x + i].b = rgba[i * 4 + 2];
+        row[x + i].a = rgba[i * 4 + 3];
     }
+}
 
-    fclose(fin);
+void save_pixels(Color4 **pixels, int width, int height, const char* filename)
+{
+    HimSource src = { pixels, canvas_read_span };
+    him_save(filename, width, height, &src, &save_options);
+}
+
+int load_pixels(Color4 **pixels, int width, int height, const char* filename)
+{
+    CanvasTarget target = { pixels, width, height };
+    // Color4 holds ints, so there is no RGBA8 canvas to hand him_load
+    HimSink sink = { &target, canvas_begin, canvas_write_span, NULL };
+    return him_load(filename, &sink);
 }
 
 
@@ -281,32 +301,10 @@ void event_scroll(int delta, Mouse* mouse, int *selected_color)
     }
 }
 
-void load_file(char* argv[], Color4 **pixels)
+void load_file(const char* filename, Color4 **pixels)
 {
-    FILE *fin = fopen(argv[4], "rb");
-
-    if (!fin)
-    {
-        printf("Failed to open %s\n", argv[4]);
-        return;
-    }
-
-    int w, h;
-    fscanf(fin, "%d %d", &w, &h);
-
-    fclose(fin);
-
-    if(w != width || h != height)
-    {
-        printf("Expected %dx%d but found %dx%d\n", width, height, w, h);
-        return;
-        //init_pixels(pixels);
-    }
-    
-    load_pixels(pixels, 128, 128, argv[4]);
-    printf("Loaded file %s successfully\n", argv[4]);
-    
-    
+    if (load_pixels(pixels, width, height, filename))
+        printf("Loaded file %s successfully\n", filename);
 }
 
 void draw_text(SDL_Renderer* renderer, const char* str, TTF_Font* font, int posx, int posy)
@@ -364,6 +362,137 @@ Color4** process_command(SDL_Window* window, SDL_Renderer* renderer, Color4** pi
 
         printf("Scale: %d\n", scale);
     }
+    else if (strcmp(tok, "format") == 0)
+    {
+        tok = strtok(NULL, " ");
+
+        if (tok && strcmp(tok, "stream") == 0)
+            save_options.format = HIM_FORMAT_LZ;
+        else if (tok && strcmp(tok, "blocks") == 0)
+            save_options.format = HIM_FORMAT_LZ_BLOCKS;
+        else if (tok && strcmp(tok, "pixels") == 0)
+            save_options.format = HIM_FORMAT_PIXELS;
+        else if (tok && strcmp(tok, "indexed") == 0)
+            save_options.format = HIM_FORMAT_INDEXED;
+        else if (tok && strcmp(tok, "tiles") == 0)
+            save_options.format = HIM_FORMAT_TILES;
+        else if (tok && strcmp(tok, "raw") == 0)
+            save_options.format = HIM_FORMAT_RAW;
+        else if (tok && strcmp(tok, "chunks") == 0)
+            save_options.format = HIM_FORMAT_CHUNKS;
+        else
+        {
+            printf("Usage: format <stream|blocks|pixels|indexed|tiles|raw|chunks>\n");
+            return pixels;
+        }
+
+        printf("Save format: %s\n", tok);
+        if (save_options.dict && save_options.format != HIM_FORMAT_LZ_BLOCKS)
+        {
+            save_options.dict = NULL;
+            printf("Saving without dictionary, only format blocks uses one\n");
+        }
+    }
+    else if (strcmp(tok, "threads") == 0)
+    {
+        tok = strtok(NULL, " ");
+        save_options.threads = tok ? atoi(tok) : 0;
+
+        printf("Save threads: %d (0 = one per CPU)\n", save_options.threads);
+    }
+    else if (strcmp(tok, "level") == 0)
+    {
+        tok = strtok(NULL, " ");
+        int level = tok ? atoi(tok) : 0;
+
+        if (level < LZ_LEVEL_FAST || level > LZ_LEVEL_BEST)
+        {
+            printf("Usage: level <%d-%d>\n", LZ_LEVEL_FAST, LZ_LEVEL_BEST);
+            return pixels;
+        }
+
+        save_options.level = level;
+        printf("Save level: %d\n", save_options.level);
+    }
+    else if (strcmp(tok, "dict") == 0)
+    {
+        tok = strtok(NULL, " ");
+
+        if (tok && strcmp(tok, "off") == 0)
+        {
+            save_options.dict = NULL;
+            printf("Saving without dictionary\n");
+            return pixels;
+        }
+
+        LZDict dict;
+        int ok = 0;
+
+        if (tok && strcmp(tok, "load") == 0)
+        {
+            tok = strtok(NULL, " ");
+            ok = tok && him_dict_load(tok, &dict);
+        }
+        else if (tok && strcmp(tok, "train") == 0)
+        {
+            char* dict_filename = strtok(NULL, " ");
+            const char* files[256];
+            int count = 0;
+
+            while (count < 256 && (tok = strtok(NULL, " ")) != NULL)
+                files[count++] = tok;
+
+            ok = dict_filename && count > 0 && him_dict_train(files, count, LZ_DICT_DEFAULT_SIZE, &dict);
+            if (ok && !him_dict_save(dict_filename, &dict))
+            {
+                him_dict_free(&dict);
+                ok = 0;
+            }
+        }
+        else
+        {
+            printf("Usage: dict <load file.dict|train file.dict a.him b.him ...|off>\n");
+            return pixels;
+        }
+
+        if (!ok)
+            return pixels;
+
+        // Every dictionary stays registered for as long as the editor runs,
+        // so files saved with an earlier one still load.
+        const LZDict* kept = him_find_dict(dict.id);
+        if (kept)
+        {
+            him_dict_free(&dict);
+        }
+        else
+        {
+            LZDict* copy = malloc(sizeof(LZDict));
+            if (!copy)
+            {
+                him_dict_free(&dict);
+                return pixels;
+            }
+
+            *copy = dict;
+            if (!him_register_dict(copy))
+            {
+                printf("Too many dictionaries, at most %d\n", HIM_MAX_DICTS);
+                him_dict_free(copy);
+                free(copy);
+                return pixels;
+            }
+            kept = copy;
+        }
+        save_options.dict = kept;
+
+        printf("Saving with dictionary %08X (%zu bytes)\n", kept->id, kept->size);
+        if (save_options.format != HIM_FORMAT_LZ_BLOCKS)
+        {
+            save_options.format = HIM_FORMAT_LZ_BLOCKS;
+            printf("Save format: blocks\n");
+        }
+    }
     else if (strcmp(tok, "clear") == 0)
     {
         init_pixels(pixels, width, height);
@@ -502,7 +631,7 @@ int main(int argc, char* argv[])
 {
     if(argc < 3)
     {
-        printf("Usage: %s <width> <height>\n", argv[0]);
+        printf("Usage: %s <width> <height> [-l file.him] [-o file.him] [-c level] [--release]\n", argv[0]);
         return 1;
     }   
 
@@ -519,30 +648,35 @@ int main(int argc, char* argv[])
 
     init_pixels(pixels, width, height);
 
-    if(argc == 5)
+    for (int i = 3; i < argc; i++)
     {
-        printf("Attempting to %s %s\n", argv[3], argv[4]);
-        if (strncmp(argv[3], "-l", 2) == 0)
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
         {
-            load_file(argv, pixels);
-
+            printf("Attempting to load %s\n", argv[i + 1]);
+            load_file(argv[i + 1], pixels);
+            i++;
         }
-        else if (strncmp(argv[3], "-o", 2) == 0)
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
         {
-            strcpy(out_filename, argv[4]);
+            strcpy(out_filename, argv[i + 1]);
+            printf("Save file: %s\n", out_filename);
+            i++;
         }
-    }
-    if (argc == 7)
-    {
-        if (strncmp(argv[3], "-l", 2) == 0)
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
         {
-            load_file(argv, pixels);
-
+            save_options.level = atoi(argv[i + 1]);
+            if (save_options.level < LZ_LEVEL_FAST)
+                save_options.level = LZ_LEVEL_FAST;
+            if (save_options.level > LZ_LEVEL_BEST)
+                save_options.level = LZ_LEVEL_BEST;
+
+            printf("Save level: %d\n", save_options.level);
+            i++;
         }
-        if (strncmp(argv[5], "-o", 2) == 0)
+        else if (strcmp(argv[i], "--release") == 0)
         {
-            strcpy(out_filename, argv[6]);
-            printf("Save file: %s\n", out_filename);
+            save_options.level = LZ_LEVEL_BEST;
+            printf("Save level: %d\n", save_options.level);
         }
     }
     printf("Pixels working\n"); 
@@ -1,5 +1,35 @@
 #include "compressor.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define LZ_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Every heap allocation goes through these; a build can point them elsewhere
+// (the benchmark counts bytes with them) by defining all three.
+#ifndef LZ_MALLOC
+#define LZ_MALLOC(size) malloc(size)
+#define LZ_CALLOC(count, size) calloc(count, size)
+#define LZ_FREE(ptr) free(ptr)
+#endif
+
+// GCC and clang only emit AVX2 inside functions that ask for it; MSVC always can.
+#if defined(LZ_X86) && (defined(__GNUC__) || defined(__clang__))
+#define LZ_TARGET(isa) __attribute__((target(isa)))
+#else
+#define LZ_TARGET(isa)
+#endif
+
 void char_to_bits(char c, int bits[8])
 {
     for (int i = 0; i < 8; i++)
@@ -15,26 +45,182 @@ void char_to_binary_string(unsigned char c, char bits[9]) {
     bits[8] = '\0';
 }
 
-Pair find_longest_match(char* buffer, int pos, int window_size, int max_look_ahead)
+// Number of equal leading bytes of a and b, at most max_len. Both must
+// have max_len readable bytes; the wide kernels never load past that.
+typedef size_t (*MatchLengthFn)(const unsigned char* a, const unsigned char* b, size_t max_len);
+
+static size_t match_length_scalar(const unsigned char* a, const unsigned char* b, size_t max_len)
+{
+    size_t len = 0;
+
+    while (len + 8 <= max_len)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        if (x != y)
+            break;
+        len += 8;
+    }
+
+    while (len < max_len && a[len] == b[len])
+        len++;
+
+    return len;
+}
+
+#ifdef LZ_X86
+
+static int count_trailing_zeros(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+LZ_TARGET("sse2")
+static size_t match_length_sse2(const unsigned char* a, const unsigned char* b, size_t max_len)
+{
+    size_t len = 0;
+
+    while (len + 16 <= max_len)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + len));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + len));
+        uint32_t diff = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFFu;
+        if (diff)
+            return len + (size_t)count_trailing_zeros(diff);
+        len += 16;
+    }
+
+    return len + match_length_scalar(a + len, b + len, max_len - len);
+}
+
+LZ_TARGET("avx2")
+static size_t match_length_avx2(const unsigned char* a, const unsigned char* b, size_t max_len)
+{
+    size_t len = 0;
+
+    while (len + 32 <= max_len)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + len));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + len));
+        uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (diff)
+            return len + (size_t)count_trailing_zeros(diff);
+        len += 32;
+    }
+
+    return len + match_length_sse2(a + len, b + len, max_len - len);
+}
+
+static int cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return 0;
+
+    // the OS has to save the YMM registers too
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return 0;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static int cpu_has_sse2(void)
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    return 1;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif
+
+static MatchLengthFn match_length_impl = match_length_scalar;
+
+static void pick_match_length(void)
+{
+#ifdef LZ_X86
+    if (cpu_has_avx2())
+        match_length_impl = match_length_avx2;
+    else if (cpu_has_sse2())
+        match_length_impl = match_length_sse2;
+#endif
+}
+
+#ifdef _WIN32
+static INIT_ONCE match_length_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK pick_match_length_once(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    (void)once;
+    (void)param;
+    (void)context;
+    pick_match_length();
+    return TRUE;
+}
+#else
+static pthread_once_t match_length_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Picks the widest kernel the CPU runs. Every entry point that goes on to
+// measure matches calls this first, so parallel_for workers never race on
+// match_length_impl and the hot loops skip the once check.
+static void match_length_init(void)
 {
+#ifdef _WIN32
+    InitOnceExecuteOnce(&match_length_once, pick_match_length_once, NULL, NULL);
+#else
+    pthread_once(&match_length_once, pick_match_length);
+#endif
+}
+
+static size_t match_length(const unsigned char* a, const unsigned char* b, size_t max_len)
+{
+    return match_length_impl(a, b, max_len);
+}
+
+Pair find_longest_match(const char* buffer, int buffer_len, int pos, int window_size, int max_look_ahead)
+{
+    match_length_init();
+
     if (pos == 0)
     {
         return (Pair) {0, 0};
     }
     int best_len = 0;
     int best_offset = 0;
-    int buffer_len = strlen(buffer);
 
     int window_start = (pos > window_size) ? pos - window_size : 0;
 
+    int max_len = buffer_len - pos;
+    if (max_len > max_look_ahead)
+        max_len = max_look_ahead;
+    if (max_len <= 0)
+        return (Pair) {0, 0};
+
     for (int i = window_start; i < pos; i++)
     {
-        int len = 0;
-
-        while (pos + len < buffer_len && len < max_look_ahead && buffer[i + len] == buffer[pos + len])
-        {
-            len++;
-        }
+        int len = (int)match_length((const unsigned char*)buffer + i, (const unsigned char*)buffer + pos, (size_t)max_len);
 
         if (len > best_len && len >= MIN_LZ)
         {
@@ -46,52 +232,278 @@ Pair find_longest_match(char* buffer, int pos, int window_size, int max_look_ahe
     return (Pair) {best_len, best_offset};
 }
 
+static uint32_t hash_prefix(const unsigned char* p)
+{
+    uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | (uint32_t)p[2];
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+int match_finder_init(MatchFinder* mf, size_t window_size, int chain_depth)
+{
+    match_length_init();
+
+    size_t ring = 1;
+    while (ring < window_size)
+        ring <<= 1;
+
+    mf->head = LZ_CALLOC((size_t)1 << HASH_BITS, sizeof(uint32_t));
+    mf->prev = LZ_CALLOC(ring, sizeof(uint32_t));
+    mf->window_size = window_size;
+    mf->window_mask = ring - 1;
+    mf->chain_depth = chain_depth;
+    mf->nice_length = MATCH_NICE_LENGTH;
+
+    if (!mf->head || !mf->prev)
+    {
+        match_finder_free(mf);
+        return 0;
+    }
+    return 1;
+}
+
+void match_finder_free(MatchFinder* mf)
+{
+    LZ_FREE(mf->head);
+    LZ_FREE(mf->prev);
+    mf->head = NULL;
+    mf->prev = NULL;
+}
+
+void match_finder_insert(MatchFinder* mf, const unsigned char* buffer, size_t buffer_len, size_t pos)
+{
+    if (pos + MIN_LZ > buffer_len)
+        return;
+
+    uint32_t h = hash_prefix(buffer + pos);
+    mf->prev[pos & mf->window_mask] = mf->head[h];
+    mf->head[h] = (uint32_t)(pos + 1);
+}
+
+Pair match_finder_find(MatchFinder* mf, const unsigned char* buffer, size_t buffer_len, size_t pos, size_t max_look_ahead)
+{
+    Pair best = {0, 0};
+
+    if (pos == 0 || pos + MIN_LZ > buffer_len)
+        return best;
+
+    size_t max_len = buffer_len - pos;
+    if (max_len > max_look_ahead)
+        max_len = max_look_ahead;
+
+    const unsigned char* cur = buffer + pos;
+    size_t best_len = 0;
+    int depth = mf->chain_depth;
+    uint32_t next = mf->head[hash_prefix(cur)];
+
+    while (next != 0)
+    {
+        size_t i = next - 1;
+        if (i >= pos || pos - i > mf->window_size)
+            break;
+
+        const unsigned char* cand = buffer + i;
+
+        // a candidate can only win if it also matches the byte that would extend the best match
+        if (cand[best_len] == cur[best_len])
+        {
+            size_t len = match_length(cand, cur, max_len);
+
+            if (len > best_len && len >= MIN_LZ)
+            {
+                best_len = len;
+                best.length = (int)len;
+                best.offset = (int)(pos - i);
+
+                if (len == max_len || (mf->chain_depth > 0 && len >= mf->nice_length))
+                    break;
+            }
+        }
+
+        if (mf->chain_depth > 0 && --depth == 0)
+            break;
+
+        uint32_t older = mf->prev[i & mf->window_mask];
+        if (older >= next)
+            break;
+        next = older;
+    }
+
+    return best;
+}
+
+int match_finder_find_all(MatchFinder* mf, const unsigned char* buffer, size_t buffer_len, size_t pos, size_t max_look_ahead, Pair* matches, int max_matches)
+{
+    if (pos == 0 || pos + MIN_LZ > buffer_len || max_matches <= 0)
+        return 0;
+
+    size_t max_len = buffer_len - pos;
+    if (max_len > max_look_ahead)
+        max_len = max_look_ahead;
+
+    const unsigned char* cur = buffer + pos;
+    size_t best_len = MIN_LZ - 1;
+    int count = 0;
+    int depth = mf->chain_depth;
+    uint32_t next = mf->head[hash_prefix(cur)];
+
+    while (next != 0)
+    {
+        size_t i = next - 1;
+        if (i >= pos || pos - i > mf->window_size)
+            break;
+
+        const unsigned char* cand = buffer + i;
+
+        if (cand[best_len] == cur[best_len])
+        {
+            size_t len = match_length(cand, cur, max_len);
+
+            if (len > best_len)
+            {
+                // keep the list sorted by length; the nearer (cheaper) offset wins each length
+                if (count == max_matches)
+                    count--;
+
+                matches[count].length = (int)len;
+                matches[count].offset = (int)(pos - i);
+                count++;
+                best_len = len;
+
+                if (len == max_len || len >= mf->nice_length)
+                    break;
+            }
+        }
+
+        if (mf->chain_depth > 0 && --depth == 0)
+            break;
+
+        uint32_t older = mf->prev[i & mf->window_mask];
+        if (older >= next)
+            break;
+        next = older;
+    }
+
+    return count;
+}
+
+// Copies a match of length bytes from offset bytes back, overlapping
+// allowed. With LZ_COPY_SLACK bytes of room behind the match it copies in
+// whole 16 or 8 byte steps and may scribble over that room; near the end
+// of the buffer it copies exactly. Short offsets are handled by doubling
+// the copied period, so even a one byte offset needs only log2 copies.
+static void copy_match(uint8_t* dst, size_t offset, size_t length, const uint8_t* limit)
+{
+    const uint8_t* src = dst - offset;
+
+    if ((size_t)(limit - dst) >= length + LZ_COPY_SLACK)
+    {
+        if (offset >= 16)
+        {
+            for (size_t i = 0; i < length; i += 16)
+                memcpy(dst + i, src + i, 16);
+            return;
+        }
+
+        if (offset == 1)
+        {
+            memset(dst, src[0], length);
+            return;
+        }
+
+        if (offset == 2 || offset == 4)
+        {
+            uint8_t pattern[8];
+            for (int i = 0; i < 8; i++)
+                pattern[i] = src[i % offset];
+
+            for (size_t i = 0; i < length; i += 8)
+                memcpy(dst + i, pattern, 8);
+            return;
+        }
+    }
+
+    size_t done = 0;
+    size_t period = offset;
+    while (done < length)
+    {
+        size_t n = length - done;
+        if (n > period)
+            n = period;
+
+        memcpy(dst + done, src, n);
+        done += n;
+        period *= 2;
+    }
+}
+
+// A match that starts before out[0] continues from the end of the
+// dictionary, which logically precedes the output.
+static void copy_dict_match(uint8_t* out, size_t op, size_t offset, size_t length, const uint8_t* limit, const LZDict* dict)
+{
+    if (offset > op)
+    {
+        size_t n = offset - op;
+        if (n > length)
+            n = length;
+
+        memcpy(out + op, dict->data + dict->size - (offset - op), n);
+        op += n;
+        length -= n;
+    }
+
+    if (length > 0)
+        copy_match(out + op, offset, length, limit);
+}
+
 void compress_string(char* buffer, char* compressed_buffer)
 {
     int buffer_len = strlen(buffer);
 
     compressed_buffer[0] = '\0';
     int pos = 0;
+    size_t out = 0;
 
     Pair match = {-1, -1};
 
-    char bits[9];
-    char temp[50];
+    const unsigned char* input = (const unsigned char*)buffer;
 
-    while (pos < buffer_len)
+    MatchFinder mf;
+    if (!match_finder_init(&mf, SEARCH_WINDOW, HASH_CHAIN_DEPTH))
     {
+        return;
+    }
 
-        int look_ahead_len = buffer_len - pos;
-        if (look_ahead_len > LOOK_AHEAD_WINDOW)
-        {
-            look_ahead_len = LOOK_AHEAD_WINDOW;
-        }
-    
-        match = find_longest_match(buffer, pos, SEARCH_WINDOW, LOOK_AHEAD_WINDOW);
+    while (pos < buffer_len)
+    {
+        match = match_finder_find(&mf, input, buffer_len, pos, LOOK_AHEAD_WINDOW);
 
         if (match.length >= MIN_LZ)
         {
-            sprintf(temp, "1 %d %d ", match.offset, match.length);
-            strcat(compressed_buffer, temp);
+            out += sprintf(compressed_buffer + out, "1 %d %d ", match.offset, match.length);
 
+            for (int i = 0; i < match.length; i++)
+            {
+                match_finder_insert(&mf, input, buffer_len, pos + i);
+            }
             pos += match.length;
         }
         else
         {
-            char_to_binary_string(buffer[pos], bits);
-            strcat(compressed_buffer, bits);
-            strcat(compressed_buffer, " ");
+            char_to_binary_string(buffer[pos], compressed_buffer + out);
+            out += 8;
+            compressed_buffer[out++] = ' ';
+            compressed_buffer[out] = '\0';
 
-            char single_char[2] = {buffer[pos], '\0'};
-            
+            match_finder_insert(&mf, input, buffer_len, pos);
             pos++;
         }
     }
+
+    match_finder_free(&mf);
 }
 
 void decompress_string(char* compressed, char* decompressed)
 {
-    decompressed[0] = '\0';
     char* token = strtok(compressed, " ");
     int pos = 0;
 
@@ -110,11 +522,14 @@ void decompress_string(char* compressed, char* decompressed)
             int offset = atoi(offset_str);
             int length = atoi(length_str);
 
-            for (int i = 0; i < length; i++)
+            if (offset <= 0 || offset > pos || length <= 0)
             {
-                decompressed[pos + i] = decompressed[pos - offset + i];
+                break;
             }
-            decompressed[pos + length] = '\0';
+
+            // the caller's buffer size is unknown, so no slack: exact copy
+            uint8_t* dst = (uint8_t*)decompressed + pos;
+            copy_match(dst, (size_t)offset, (size_t)length, dst + length);
             pos += length;
         }
         else
@@ -128,78 +543,2036 @@ void decompress_string(char* compressed, char* decompressed)
 
             decompressed[pos] = c;
             pos++;
-            decompressed[pos] = '\0';
         }
 
         token = strtok(NULL, " ");
     }
+
+    decompressed[pos] = '\0';
 }
 
-int run()
+// Reads the digits atoi would, from a token that ends at the next space.
+static int legacy_number(const char** p, const char* end, size_t* value)
 {
-    char input1[] = "ABABABABABABABAB";
-    char input2[] = "HELLO HELLO HELLO HELLO";
-    char input3[] = "AAAAAAAAAAAAAAAAAAAA";
-    char input4[] = "The quick brown fox jumps over the lazy dog";
+    const char* c = *p;
+    while (c < end && *c == ' ')
+        c++;
 
-    char compressed[8192];
-    char decompressed[8192];
+    size_t v = 0;
+    const char* digits = c;
+    while (c < end && *c >= '0' && *c <= '9' && v <= SEARCH_WINDOW)
+        v = v * 10 + (size_t)(*c++ - '0');
 
-    char* tests[] = { input1, input2, input3, input4 };
-    int num_tests = sizeof(tests) / sizeof(tests[0]);
+    while (c < end && *c != ' ')
+        c++;
 
-    for (int i = 0; i < num_tests; i++)
-    {
-        printf("==== TEST %d ====\n", i + 1);
-        printf("Original:     \"%s\"\n", tests[i]);
+    *p = c;
+    *value = v;
+    return c > digits;
+}
 
-        int original_bytes = strlen(tests[i]);
-        int original_bits = original_bytes * 8;
+// Hands history[flushed, hist_len) to the sink.
+static int legacy_flush(uint8_t* history, size_t* flushed, size_t hist_len, LZSinkFn sink, void* user)
+{
+    int ok = hist_len == *flushed || sink(user, history + *flushed, hist_len - *flushed);
+    *flushed = hist_len;
+    return ok;
+}
 
-        compress_string(tests[i], compressed);
-        int compressed_bytes = strlen(compressed);
+size_t decompress_string_stream(const char* compressed, size_t len, LZSinkFn sink, void* user)
+{
+    // slides by a whole window at a time, so each byte is moved at most once
+    size_t window = SEARCH_WINDOW;
+    size_t cap = 2 * window;
+    uint8_t* history = (uint8_t*)LZ_MALLOC(cap);
+    if (!history)
+        return COMPRESS_ERROR;
 
-        printf("Compressed:   %s\n", compressed);
+    const char* p = compressed;
+    const char* end = compressed + len;
+    size_t hist_len = 0;
+    size_t flushed = 0;
+    size_t total = 0;
+    int ok = 1;
 
-        char compressed_copy[8192];
-        strcpy(compressed_copy, compressed);
+    while (ok)
+    {
+        while (p < end && *p == ' ')
+            p++;
+        if (p == end)
+            break;
 
-        decompress_string(compressed_copy, decompressed);
-        printf("Decompressed: \"%s\"\n", decompressed);
+        const char* token = p;
+        while (p < end && *p != ' ')
+            p++;
 
-        printf("Result: %s\n",
-               strcmp(tests[i], decompressed) == 0 ? "PASS" : "FAIL");
+        size_t offset = 1;
+        size_t length = 1;
+        int is_match = p - token == 1 && token[0] == '1';
 
-        int total_bits = 0;
-        char parse_buf[8192];
-        strcpy(parse_buf, compressed);
+        if (is_match && !(legacy_number(&p, end, &offset) && legacy_number(&p, end, &length)))
+            break;
+        if (is_match && (offset == 0 || offset > total || offset > window || length == 0))
+            break;
+        if (!is_match && p - token < 8)
+            break;
 
-        char* token = strtok(parse_buf, " ");
-        while (token)
+        while (length > 0 && ok)
         {
-            if (strcmp(token, "1") == 0)
+            if (hist_len == cap)
+            {
+                ok = legacy_flush(history, &flushed, hist_len, sink, user);
+                memmove(history, history + cap - window, window);
+                hist_len = window;
+                flushed = window;
+            }
+
+            size_t n = cap - hist_len < length ? cap - hist_len : length;
+
+            if (is_match)
             {
-                strtok(NULL, " ");
-                strtok(NULL, " ");
-                total_bits += 18;
+                copy_match(history + hist_len, offset, n, history + cap);
             }
             else
             {
-                total_bits += 9;
+                unsigned c = 0;
+                for (int i = 0; i < 8; i++)
+                    c = (c << 1) | (unsigned)(token[i] - '0');
+                history[hist_len] = (uint8_t)c;
             }
-            token = strtok(NULL, " ");
-        }
 
-        double theoretical_factor = (double)total_bits / original_bits * 100.0;
-        double ascii_factor = (double)compressed_bytes / original_bytes * 100.0;
+            hist_len += n;
+            total += n;
+            length -= n;
+        }
 
-        printf("Theoretical size: %.2f%% of original\n", theoretical_factor);
+        if (ok && hist_len - flushed >= LZ_DECODE_CHUNK)
+            ok = legacy_flush(history, &flushed, hist_len, sink, user);
+    }
 
-        printf("Original size:   %d bytes\n", original_bytes);
-        printf("Compressed size: %d bytes\n", compressed_bytes);
+    ok = ok && legacy_flush(history, &flushed, hist_len, sink, user);
+    LZ_FREE(history);
+    return ok ? total : COMPRESS_ERROR;
+}
 
-        printf("\n");
+static size_t write_varint(uint8_t* out, size_t pos, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        out[pos++] = (uint8_t)(v | 0x80);
+        v >>= 7;
     }
+    out[pos++] = (uint8_t)v;
+    return pos;
+}
 
+static int read_varint(const uint8_t* in, size_t in_len, size_t* pos, uint32_t* v)
+{
+    uint32_t result = 0;
+    int shift = 0;
+
+    while (*pos < in_len && shift < 32)
+    {
+        uint8_t b = in[(*pos)++];
+        result |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            *v = result;
+            return 1;
+        }
+        shift += 7;
+    }
     return 0;
 }
+
+static size_t varint_size(uint32_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static void write_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t compress_bound(size_t in_len)
+{
+    // the header byte and a dictionary ID, every byte a literal, plus one control byte per eight items
+    return 5 + in_len + (in_len + 7) / 8;
+}
+
+static void token_writer_init(TokenWriter* tw, uint8_t* out, size_t cap)
+{
+    tw->out = out;
+    tw->cap = cap;
+    tw->len = 0;
+    tw->ctrl_pos = 0;
+    tw->ctrl_bit = 8;
+}
+
+static int token_open_item(TokenWriter* tw, size_t item_size)
+{
+    size_t need = item_size + (tw->ctrl_bit == 8 ? 1 : 0);
+    if (tw->cap - tw->len < need)
+        return 0;
+
+    if (tw->ctrl_bit == 8)
+    {
+        tw->ctrl_pos = tw->len;
+        tw->out[tw->len++] = 0;
+        tw->ctrl_bit = 0;
+    }
+    return 1;
+}
+
+static int token_put_literal(TokenWriter* tw, uint8_t c)
+{
+    if (!token_open_item(tw, 1))
+        return 0;
+
+    tw->out[tw->len++] = c;
+    tw->ctrl_bit++;
+    return 1;
+}
+
+static int token_put_match(TokenWriter* tw, int length, int offset)
+{
+    uint32_t l = (uint32_t)(length - MIN_LZ);
+    uint32_t o = (uint32_t)(offset - 1);
+
+    if (!token_open_item(tw, varint_size(l) + varint_size(o)))
+        return 0;
+
+    tw->out[tw->ctrl_pos] |= (uint8_t)(1 << tw->ctrl_bit);
+    tw->len = write_varint(tw->out, tw->len, l);
+    tw->len = write_varint(tw->out, tw->len, o);
+    tw->ctrl_bit++;
+    return 1;
+}
+
+// Iterates over the items of a raw LZ stream (after the header byte).
+typedef struct
+{
+    const uint8_t* in;
+    size_t len;
+    size_t pos;
+    uint8_t ctrl;
+    int bit;
+} TokenReader;
+
+// 1 = literal in *a, 2 = match with length - MIN_LZ in *a and offset - 1 in *b, 0 = end, -1 = corrupt
+static int token_next(TokenReader* tr, uint32_t* a, uint32_t* b)
+{
+    if (tr->pos >= tr->len)
+        return 0;
+
+    if (tr->bit == 8)
+    {
+        tr->ctrl = tr->in[tr->pos++];
+        tr->bit = 0;
+        if (tr->pos >= tr->len)
+            return 0;
+    }
+
+    int is_match = tr->ctrl & (1 << tr->bit);
+    tr->bit++;
+
+    if (!is_match)
+    {
+        *a = tr->in[tr->pos++];
+        return 1;
+    }
+
+    if (!read_varint(tr->in, tr->len, &tr->pos, a) || !read_varint(tr->in, tr->len, &tr->pos, b))
+        return -1;
+    return 2;
+}
+
+typedef struct
+{
+    uint8_t* out;
+    size_t cap;
+    size_t len;
+    uint64_t acc;
+    int count;
+    int overflow;
+} BitWriter;
+
+static void bit_put(BitWriter* bw, uint32_t bits, int n)
+{
+    bw->acc |= (uint64_t)bits << bw->count;
+    bw->count += n;
+
+    while (bw->count >= 8)
+    {
+        if (bw->len == bw->cap)
+        {
+            bw->overflow = 1;
+            bw->count = 0;
+            bw->acc = 0;
+            return;
+        }
+        bw->out[bw->len++] = (uint8_t)bw->acc;
+        bw->acc >>= 8;
+        bw->count -= 8;
+    }
+}
+
+static void bit_flush(BitWriter* bw)
+{
+    if (bw->count > 0)
+        bit_put(bw, 0, 8 - bw->count);
+}
+
+typedef struct
+{
+    const uint8_t* in;
+    size_t len;
+    size_t pos;
+    uint64_t acc;
+    int count;
+    size_t padding;
+} BitReader;
+
+// Keeps at least 57 bits in the accumulator; past the end it shifts in
+// zeros and counts them, so running off the input is caught afterwards.
+static void bit_refill(BitReader* br)
+{
+    while (br->count <= 56)
+    {
+        uint64_t b = 0;
+        if (br->pos < br->len)
+            b = br->in[br->pos++];
+        else
+            br->padding++;
+
+        br->acc |= b << br->count;
+        br->count += 8;
+    }
+}
+
+static uint32_t bit_get(BitReader* br, int n)
+{
+    uint32_t v = (uint32_t)(br->acc & (((uint64_t)1 << n) - 1));
+    br->acc >>= n;
+    br->count -= n;
+    return v;
+}
+
+static int bit_overrun(const BitReader* br)
+{
+    return (size_t)br->count < br->padding * 8;
+}
+
+// Lengths and offsets: values below 16 are their own code, larger ones send
+// their top two bits in the code and the rest as extra bits.
+static int value_code(uint32_t v, int* extra_bits)
+{
+    if (v < 16)
+    {
+        *extra_bits = 0;
+        return (int)v;
+    }
+
+    int n = 31;
+    while (!(v >> n))
+        n--;
+
+    *extra_bits = n - 1;
+    return 16 + (n - 4) * 2 + (int)((v >> (n - 1)) & 1);
+}
+
+static int value_extra_bits(int code)
+{
+    return code < 16 ? 0 : (code - 16) / 2 + 3;
+}
+
+static uint32_t value_base(int code)
+{
+    if (code < 16)
+        return (uint32_t)code;
+
+    int n = (code - 16) / 2 + 4;
+    return ((uint32_t)1 << n) | ((uint32_t)(code & 1) << (n - 1));
+}
+
+typedef struct
+{
+    uint32_t freq;
+    int symbol;
+} HuffLeaf;
+
+static int compare_leaves(const void* a, const void* b)
+{
+    const HuffLeaf* x = (const HuffLeaf*)a;
+    const HuffLeaf* y = (const HuffLeaf*)b;
+    if (x->freq != y->freq)
+        return x->freq < y->freq ? -1 : 1;
+    return x->symbol - y->symbol;
+}
+
+// Huffman code lengths limited to HUFF_MAX_BITS; over-long codes are cut
+// and the Kraft sum is repaired by lengthening the shortest ones that can
+// take it.
+static void huff_build_lengths(const uint32_t* freq, int n, uint8_t* lengths)
+{
+    HuffLeaf leaves[HUFF_LITLEN_SYMBOLS];
+    uint32_t weight[2 * HUFF_LITLEN_SYMBOLS];
+    int parent[2 * HUFF_LITLEN_SYMBOLS];
+    int depth[2 * HUFF_LITLEN_SYMBOLS];
+    int m = 0;
+
+    memset(lengths, 0, (size_t)n);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (freq[i])
+        {
+            leaves[m].freq = freq[i];
+            leaves[m].symbol = i;
+            m++;
+        }
+    }
+
+    if (m == 0)
+        return;
+    if (m == 1)
+    {
+        lengths[leaves[0].symbol] = 1;
+        return;
+    }
+
+    qsort(leaves, (size_t)m, sizeof(HuffLeaf), compare_leaves);
+
+    for (int i = 0; i < m; i++)
+        weight[i] = leaves[i].freq;
+
+    // leaves and internal nodes are both created in increasing weight, so
+    // the two smallest are always at the front of one of the two queues
+    int next_leaf = 0;
+    int next_node = m;
+    for (int k = m; k < 2 * m - 1; k++)
+    {
+        int pick[2];
+        for (int j = 0; j < 2; j++)
+        {
+            if (next_leaf < m && (next_node >= k || weight[next_leaf] <= weight[next_node]))
+                pick[j] = next_leaf++;
+            else
+                pick[j] = next_node++;
+        }
+        weight[k] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = k;
+        parent[pick[1]] = k;
+    }
+
+    int count[32] = {0};
+    depth[2 * m - 2] = 0;
+    for (int k = 2 * m - 3; k >= 0; k--)
+    {
+        depth[k] = depth[parent[k]] + 1;
+        if (k < m)
+            count[depth[k] > HUFF_MAX_BITS ? HUFF_MAX_BITS : depth[k]]++;
+    }
+
+    uint32_t total = 0;
+    for (int i = 1; i <= HUFF_MAX_BITS; i++)
+        total += (uint32_t)count[i] << (HUFF_MAX_BITS - i);
+
+    while (total > (1u << HUFF_MAX_BITS))
+    {
+        count[HUFF_MAX_BITS]--;
+        for (int i = HUFF_MAX_BITS - 1; i > 0; i--)
+        {
+            if (count[i])
+            {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // rarest symbols get the longest codes
+    int leaf = 0;
+    for (int len = HUFF_MAX_BITS; len > 0; len--)
+    {
+        for (int i = 0; i < count[len]; i++)
+            lengths[leaves[leaf++].symbol] = (uint8_t)len;
+    }
+}
+
+// Canonical codes, bit-reversed for the LSB-first bit stream.
+static void huff_build_codes(const uint8_t* lengths, int n, uint16_t* codes)
+{
+    int count[HUFF_MAX_BITS + 1] = {0};
+    uint32_t next[HUFF_MAX_BITS + 1];
+
+    for (int i = 0; i < n; i++)
+        count[lengths[i]]++;
+    count[0] = 0;
+
+    uint32_t code = 0;
+    for (int len = 1; len <= HUFF_MAX_BITS; len++)
+    {
+        code = (code + (uint32_t)count[len - 1]) << 1;
+        next[len] = code;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        int len = lengths[i];
+        if (!len)
+            continue;
+
+        uint32_t c = next[len]++;
+        uint32_t reversed = 0;
+        for (int b = 0; b < len; b++)
+            reversed |= ((c >> b) & 1) << (len - 1 - b);
+        codes[i] = (uint16_t)reversed;
+    }
+}
+
+// One entry per HUFF_MAX_BITS bit pattern: symbol << 4 | code length, 0 = no code.
+static int huff_build_table(const uint8_t* lengths, int n, uint16_t* table)
+{
+    uint16_t codes[HUFF_LITLEN_SYMBOLS];
+    uint32_t total = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (lengths[i])
+            total += 1u << (HUFF_MAX_BITS - lengths[i]);
+    }
+    if (total > (1u << HUFF_MAX_BITS))
+        return 0;
+
+    memset(table, 0, sizeof(uint16_t) << HUFF_MAX_BITS);
+    huff_build_codes(lengths, n, codes);
+
+    for (int i = 0; i < n; i++)
+    {
+        int len = lengths[i];
+        if (!len)
+            continue;
+
+        for (uint32_t fill = codes[i]; fill < (1u << HUFF_MAX_BITS); fill += 1u << len)
+            table[fill] = (uint16_t)((i << 4) | len);
+    }
+    return 1;
+}
+
+static void huff_write_lengths(BitWriter* bw, const uint8_t* lengths, int n)
+{
+    int i = 0;
+    while (i < n)
+    {
+        int run = 0;
+        while (i + run < n && run < 256 && lengths[i + run] == 0)
+            run++;
+
+        if (run >= 3)
+        {
+            bit_put(bw, HUFF_ZERO_RUN, 4);
+            bit_put(bw, (uint32_t)(run - 1), 8);
+            i += run;
+        }
+        else
+        {
+            bit_put(bw, lengths[i], 4);
+            i++;
+        }
+    }
+}
+
+static int huff_read_lengths(BitReader* br, uint8_t* lengths, int n)
+{
+    int i = 0;
+    while (i < n)
+    {
+        bit_refill(br);
+        uint32_t v = bit_get(br, 4);
+
+        if (v == HUFF_ZERO_RUN)
+        {
+            uint32_t run = bit_get(br, 8) + 1;
+            if (run > (uint32_t)(n - i))
+                return 0;
+            memset(lengths + i, 0, run);
+            i += (int)run;
+        }
+        else if (v <= HUFF_MAX_BITS)
+        {
+            lengths[i++] = (uint8_t)v;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    return !bit_overrun(br);
+}
+
+// Re-codes a raw LZ stream made by compress_dict, copying its header bytes
+// as they are. Fails with COMPRESS_ERROR when the result does not fit,
+// i.e. is not smaller.
+static size_t entropy_encode(const uint8_t* lz, size_t lz_len, size_t header, size_t raw_size, uint8_t* out, size_t out_cap)
+{
+    uint32_t litlen_freq[HUFF_LITLEN_SYMBOLS] = {0};
+    uint32_t offset_freq[HUFF_OFFSET_SYMBOLS] = {0};
+    uint8_t litlen_lengths[HUFF_LITLEN_SYMBOLS];
+    uint8_t offset_lengths[HUFF_OFFSET_SYMBOLS];
+    uint16_t litlen_codes[HUFF_LITLEN_SYMBOLS];
+    uint16_t offset_codes[HUFF_OFFSET_SYMBOLS];
+
+    if (lz_len < header || raw_size > UINT32_MAX || out_cap < header + 5)
+        return COMPRESS_ERROR;
+
+    TokenReader tr = { lz, lz_len, header, 0, 8 };
+    uint32_t a, b;
+    int kind;
+    int extra;
+
+    while ((kind = token_next(&tr, &a, &b)) > 0)
+    {
+        if (kind == 1)
+        {
+            litlen_freq[a]++;
+        }
+        else
+        {
+            litlen_freq[256 + value_code(a, &extra)]++;
+            offset_freq[value_code(b, &extra)]++;
+        }
+    }
+    if (kind < 0)
+        return COMPRESS_ERROR;
+
+    huff_build_lengths(litlen_freq, HUFF_LITLEN_SYMBOLS, litlen_lengths);
+    huff_build_lengths(offset_freq, HUFF_OFFSET_SYMBOLS, offset_lengths);
+    huff_build_codes(litlen_lengths, HUFF_LITLEN_SYMBOLS, litlen_codes);
+    huff_build_codes(offset_lengths, HUFF_OFFSET_SYMBOLS, offset_codes);
+
+    memcpy(out, lz, header);
+    out[0] |= LZ_HEADER_ENTROPY;
+    size_t out_header = write_varint(out, header, (uint32_t)raw_size);
+
+    BitWriter bw = { out + out_header, out_cap - out_header, 0, 0, 0, 0 };
+    huff_write_lengths(&bw, litlen_lengths, HUFF_LITLEN_SYMBOLS);
+    huff_write_lengths(&bw, offset_lengths, HUFF_OFFSET_SYMBOLS);
+
+    TokenReader again = { lz, lz_len, header, 0, 8 };
+    while (!bw.overflow && (kind = token_next(&again, &a, &b)) > 0)
+    {
+        if (kind == 1)
+        {
+            bit_put(&bw, litlen_codes[a], litlen_lengths[a]);
+            continue;
+        }
+
+        int code = value_code(a, &extra);
+        bit_put(&bw, litlen_codes[256 + code], litlen_lengths[256 + code]);
+        bit_put(&bw, a - value_base(code), extra);
+
+        code = value_code(b, &extra);
+        bit_put(&bw, offset_codes[code], offset_lengths[code]);
+        bit_put(&bw, b - value_base(code), extra);
+    }
+    bit_flush(&bw);
+
+    if (bw.overflow)
+        return COMPRESS_ERROR;
+
+    return out_header + bw.len;
+}
+
+static size_t entropy_decode(const uint8_t* in, size_t in_len, size_t header, uint8_t* out, size_t out_cap, const LZDict* dict)
+{
+    uint8_t litlen_lengths[HUFF_LITLEN_SYMBOLS];
+    uint8_t offset_lengths[HUFF_OFFSET_SYMBOLS];
+    uint16_t litlen_table[1 << HUFF_MAX_BITS];
+    uint16_t offset_table[1 << HUFF_MAX_BITS];
+
+    size_t ip = header;
+    size_t dict_size = dict ? dict->size : 0;
+    uint32_t size;
+    if (!read_varint(in, in_len, &ip, &size) || size > out_cap)
+        return COMPRESS_ERROR;
+
+    BitReader br = { in + ip, in_len - ip, 0, 0, 0, 0 };
+
+    if (!huff_read_lengths(&br, litlen_lengths, HUFF_LITLEN_SYMBOLS) ||
+        !huff_read_lengths(&br, offset_lengths, HUFF_OFFSET_SYMBOLS) ||
+        !huff_build_table(litlen_lengths, HUFF_LITLEN_SYMBOLS, litlen_table) ||
+        !huff_build_table(offset_lengths, HUFF_OFFSET_SYMBOLS, offset_table))
+        return COMPRESS_ERROR;
+
+    const uint32_t mask = (1u << HUFF_MAX_BITS) - 1;
+    size_t op = 0;
+
+    while (op < size)
+    {
+        // enough for a code plus its longest extra bits, several literals per refill
+        if (br.count < HUFF_MAX_BITS + 30)
+            bit_refill(&br);
+
+        uint16_t entry = litlen_table[br.acc & mask];
+        if (!entry)
+            return COMPRESS_ERROR;
+        bit_get(&br, entry & 15);
+
+        int sym = entry >> 4;
+        if (sym < 256)
+        {
+            out[op++] = (uint8_t)sym;
+            continue;
+        }
+
+        int code = sym - 256;
+        int extra = value_extra_bits(code);
+        uint32_t length = value_base(code) + bit_get(&br, extra) + MIN_LZ;
+
+        if (br.count < HUFF_MAX_BITS + 30)
+            bit_refill(&br);
+        entry = offset_table[br.acc & mask];
+        if (!entry)
+            return COMPRESS_ERROR;
+        bit_get(&br, entry & 15);
+
+        code = entry >> 4;
+        extra = value_extra_bits(code);
+        uint32_t offset = value_base(code) + bit_get(&br, extra) + 1;
+
+        if (length > MAX_LZ || offset > op + dict_size || length > size - op)
+            return COMPRESS_ERROR;
+
+        copy_dict_match(out, op, offset, length, out + out_cap, dict);
+        op += length;
+    }
+
+    if (bit_overrun(&br))
+        return COMPRESS_ERROR;
+
+    return op;
+}
+
+// window log, chain depth, min match, max match, nice length, parse, long distance
+static const LZParams level_params[LZ_LEVEL_BEST] =
+{
+    { 16, 4, 4, MAX_LZ, 32, LZ_PARSE_GREEDY, 0 },
+    { 18, 8, 4, MAX_LZ, 64, LZ_PARSE_GREEDY, 0 },
+    { 20, 16, 3, MAX_LZ, 128, LZ_PARSE_GREEDY, 0 },
+    { 20, 32, 3, MAX_LZ, 256, LZ_PARSE_LAZY, 1 },
+    { 22, 64, 3, MAX_LZ, 1024, LZ_PARSE_LAZY, 1 },
+    { 22, 128, 3, MAX_LZ, KB(4), LZ_PARSE_LAZY, 1 },
+    { 22, 128, 3, MAX_LZ, 256, LZ_PARSE_OPTIMAL, 1 },
+    { 22, 256, 3, MAX_LZ, 256, LZ_PARSE_OPTIMAL, 1 },
+    { 22, 512, 3, MAX_LZ, 512, LZ_PARSE_OPTIMAL, 1 },
+};
+
+void lz_level_params(int level, LZParams* params)
+{
+    if (level < LZ_LEVEL_FAST)
+        level = LZ_LEVEL_FAST;
+    if (level > LZ_LEVEL_BEST)
+        level = LZ_LEVEL_BEST;
+
+    *params = level_params[level - 1];
+}
+
+// Inserts every position in [*next_insert, upto) into the hash chains, once.
+// The parsers share *next_insert, so one input can be parsed in pieces.
+static void insert_upto(MatchFinder* mf, const uint8_t* in, size_t in_len, size_t* next_insert, size_t upto)
+{
+    while (*next_insert < upto)
+    {
+        match_finder_insert(mf, in, in_len, *next_insert);
+        (*next_insert)++;
+    }
+}
+
+// A short match far back can take more bytes than the literals it replaces,
+// which would break compress_bound.
+static int match_pays(Pair match, const LZParams* params)
+{
+    return match.length >= params->min_match
+        && varint_size((uint32_t)(match.length - MIN_LZ)) + varint_size((uint32_t)(match.offset - 1)) <= (size_t)match.length;
+}
+
+static size_t parse_greedy(MatchFinder* mf, const uint8_t* in, size_t in_len, size_t start, const LZParams* params, size_t* next_insert, TokenWriter* tw)
+{
+    size_t pos = start;
+    insert_upto(mf, in, in_len, next_insert, start);
+
+    while (pos < in_len)
+    {
+        Pair match = match_finder_find(mf, in, in_len, pos, (size_t)params->max_match);
+
+        if (match_pays(match, params))
+        {
+            if (!token_put_match(tw, match.length, match.offset))
+                break;
+            pos += match.length;
+        }
+        else
+        {
+            if (!token_put_literal(tw, in[pos]))
+                break;
+            pos++;
+        }
+        insert_upto(mf, in, in_len, next_insert, pos);
+    }
+
+    return pos;
+}
+
+// Like greedy, but before taking a match it looks one byte further; if a
+// longer match starts there, the current byte goes out as a literal instead.
+static size_t parse_lazy(MatchFinder* mf, const uint8_t* in, size_t in_len, size_t start, const LZParams* params, size_t* next_insert, TokenWriter* tw)
+{
+    size_t pos = start;
+    insert_upto(mf, in, in_len, next_insert, start);
+    Pair match = match_finder_find(mf, in, in_len, pos, (size_t)params->max_match);
+
+    while (pos < in_len)
+    {
+        if (match_pays(match, params))
+        {
+            if ((size_t)match.length < mf->nice_length && pos + 1 < in_len)
+            {
+                insert_upto(mf, in, in_len, next_insert, pos + 1);
+                Pair next = match_finder_find(mf, in, in_len, pos + 1, (size_t)params->max_match);
+
+                if (next.length > match.length && match_pays(next, params))
+                {
+                    if (!token_put_literal(tw, in[pos]))
+                        break;
+                    pos++;
+                    match = next;
+                    continue;
+                }
+            }
+
+            if (!token_put_match(tw, match.length, match.offset))
+                break;
+            pos += match.length;
+        }
+        else
+        {
+            if (!token_put_literal(tw, in[pos]))
+                break;
+            pos++;
+        }
+
+        insert_upto(mf, in, in_len, next_insert, pos);
+        match = match_finder_find(mf, in, in_len, pos, (size_t)params->max_match);
+    }
+
+    return pos;
+}
+
+static uint32_t literal_price(void)
+{
+    return 9;
+}
+
+static uint32_t match_price(size_t length, size_t offset)
+{
+    return 1 + 8 * (uint32_t)(varint_size((uint32_t)(length - MIN_LZ)) + varint_size((uint32_t)(offset - 1)));
+}
+
+// Price-based parse: for each block of LZ_OPT_BLOCK positions, a shortest
+// path over "bits needed to reach position i" picks between literals and
+// every length of every match the hash chains offer. Matches of the level's
+// nice_length or more are taken as they come, which keeps long transparent
+// runs linear and bounds the lengths priced at each position.
+// opt holds LZ_OPT_ARRAYS arrays of LZ_OPT_BLOCK + 1 entries
+static size_t parse_optimal(MatchFinder* mf, const uint8_t* in, size_t in_len, size_t start, const LZParams* params, uint32_t* opt, size_t* next_insert, TokenWriter* tw)
+{
+    uint32_t* cost = opt;
+    uint32_t* from_len = cost + LZ_OPT_BLOCK + 1;
+    uint32_t* from_off = from_len + LZ_OPT_BLOCK + 1;
+    uint32_t* path = from_off + LZ_OPT_BLOCK + 1;
+
+    size_t pos = start;
+    size_t misses = 0;
+    int ok = 1;
+
+    while (ok && pos < in_len)
+    {
+        size_t block_len = in_len - pos;
+        if (block_len > LZ_OPT_BLOCK)
+            block_len = LZ_OPT_BLOCK;
+
+        for (size_t i = 0; i <= block_len; i++)
+            cost[i] = UINT32_MAX;
+        cost[0] = 0;
+
+        size_t end = block_len;
+        Pair forced = {0, 0};
+
+        for (size_t i = 0; i < block_len; i++)
+        {
+            size_t p = pos + i;
+            Pair matches[LZ_OPT_MAX_MATCHES];
+
+            // over a stretch with nothing worth pricing, noise mostly,
+            // search only as deep as the greedy levels do
+            int depth = mf->chain_depth;
+            if (misses >= LZ_OPT_MISS_RUN && depth > LZ_OPT_MISS_DEPTH)
+                mf->chain_depth = LZ_OPT_MISS_DEPTH;
+
+            insert_upto(mf, in, in_len, next_insert, p);
+            int count = match_finder_find_all(mf, in, in_len, p, (size_t)params->max_match, matches, LZ_OPT_MAX_MATCHES);
+            mf->chain_depth = depth;
+
+            if (count > 0 && matches[count - 1].length >= LZ_OPT_MISS_LENGTH)
+                misses = 0;
+            else
+                misses++;
+
+            if (count > 0 && matches[count - 1].length >= params->nice_length)
+            {
+                end = i;
+                forced = matches[count - 1];
+                break;
+            }
+
+            if (cost[i] + literal_price() < cost[i + 1])
+            {
+                cost[i + 1] = cost[i] + literal_price();
+                from_len[i + 1] = 1;
+                from_off[i + 1] = 0;
+            }
+
+            // a match is dominated by the next longer one when both offsets
+            // cost the same, so only the longest per offset size is priced
+            size_t len = (size_t)params->min_match;
+            for (int k = 0; k < count; k++)
+            {
+                size_t offset_size = varint_size((uint32_t)(matches[k].offset - 1));
+                if (k + 1 < count && varint_size((uint32_t)(matches[k + 1].offset - 1)) == offset_size)
+                    continue;
+
+                size_t max_len = (size_t)matches[k].length;
+                if (max_len > block_len - i)
+                    max_len = block_len - i;
+
+                for (; len <= max_len; len++)
+                {
+                    uint32_t c = cost[i] + match_price(len, (size_t)matches[k].offset);
+                    if (c < cost[i + len])
+                    {
+                        cost[i + len] = c;
+                        from_len[i + len] = (uint32_t)len;
+                        from_off[i + len] = (uint32_t)matches[k].offset;
+                    }
+                }
+            }
+        }
+
+        size_t steps = 0;
+        for (size_t i = end; i > 0; i -= from_len[i])
+            path[steps++] = (uint32_t)i;
+
+        while (ok && steps > 0)
+        {
+            size_t i = path[--steps];
+            if (from_off[i] == 0)
+                ok = token_put_literal(tw, in[pos + i - 1]);
+            else
+                ok = token_put_match(tw, (int)from_len[i], (int)from_off[i]);
+        }
+
+        pos += end;
+
+        if (ok && forced.length > 0)
+        {
+            ok = token_put_match(tw, forced.length, forced.offset);
+            pos += (size_t)forced.length;
+        }
+    }
+
+    return ok ? pos : 0;
+}
+
+static void* lz_default_alloc(void* user, size_t size)
+{
+    (void)user;
+    return LZ_MALLOC(size);
+}
+
+static void lz_default_free(void* user, void* ptr)
+{
+    (void)user;
+    LZ_FREE(ptr);
+}
+
+void lz_context_init(LZContext* ctx, int level, const LZAllocator* allocator)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    lz_level_params(level, &ctx->params);
+
+    // splitmix64, so the gear table (and the output) is the same everywhere
+    uint64_t seed = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        ctx->gear[i] = z ^ (z >> 31);
+    }
+
+    if (allocator)
+    {
+        ctx->allocator = *allocator;
+    }
+    else
+    {
+        ctx->allocator.alloc = lz_default_alloc;
+        ctx->allocator.free = lz_default_free;
+    }
+}
+
+void lz_context_free(LZContext* ctx)
+{
+    ctx->allocator.free(ctx->allocator.user, ctx->mf.head);
+    ctx->allocator.free(ctx->allocator.user, ctx->mf.prev);
+    ctx->allocator.free(ctx->allocator.user, ctx->window);
+    ctx->allocator.free(ctx->allocator.user, ctx->opt);
+    ctx->allocator.free(ctx->allocator.user, ctx->scratch);
+    ctx->allocator.free(ctx->allocator.user, ctx->ldm);
+
+    ctx->mf.head = NULL;
+    ctx->mf.prev = NULL;
+    ctx->ring_cap = 0;
+    ctx->window = NULL;
+    ctx->window_cap = 0;
+    ctx->opt = NULL;
+    ctx->scratch = NULL;
+    ctx->scratch_cap = 0;
+    ctx->ldm = NULL;
+    ctx->ldm_cap = 0;
+}
+
+// Grows *buffer to at least size bytes, rounded up to a power of two so a
+// run of slightly different inputs settles on one allocation. The old
+// contents are not kept.
+static int lz_context_reserve(LZContext* ctx, void** buffer, size_t* cap, size_t size)
+{
+    if (*buffer && *cap >= size)
+        return 1;
+
+    size_t grown = 4096;
+    while (grown < size)
+        grown <<= 1;
+
+    ctx->allocator.free(ctx->allocator.user, *buffer);
+    *buffer = ctx->allocator.alloc(ctx->allocator.user, grown);
+    *cap = *buffer ? grown : 0;
+    return *buffer != NULL;
+}
+
+static int lz_context_prepare(LZContext* ctx, int window_log)
+{
+    match_length_init();
+
+    const LZParams* params = &ctx->params;
+    size_t head_bytes = ((size_t)1 << HASH_BITS) * sizeof(uint32_t);
+
+    // head[] starts out empty and lz_context_clear leaves it that way after every call
+    if (!ctx->mf.head)
+    {
+        ctx->mf.head = (uint32_t*)ctx->allocator.alloc(ctx->allocator.user, head_bytes);
+        if (!ctx->mf.head)
+            return 0;
+        memset(ctx->mf.head, 0, head_bytes);
+    }
+
+    // prev[] needs no clearing: chains only reach positions inserted by this call
+    size_t ring_bytes = ctx->ring_cap * sizeof(uint32_t);
+    if (!lz_context_reserve(ctx, (void**)&ctx->mf.prev, &ring_bytes, ((size_t)1 << window_log) * sizeof(uint32_t)))
+        return 0;
+    ctx->ring_cap = ring_bytes / sizeof(uint32_t);
+
+    if (params->parse == LZ_PARSE_OPTIMAL && !ctx->opt)
+    {
+        ctx->opt = (uint32_t*)ctx->allocator.alloc(ctx->allocator.user, LZ_OPT_ARRAYS * (LZ_OPT_BLOCK + 1) * sizeof(uint32_t));
+        if (!ctx->opt)
+            return 0;
+    }
+
+    ctx->mf.window_size = (size_t)1 << window_log;
+    ctx->mf.window_mask = ctx->ring_cap - 1;
+    ctx->mf.chain_depth = params->chain_depth;
+    ctx->mf.nice_length = (size_t)params->nice_length;
+    return 1;
+}
+
+// Small inputs touch few head[] slots, so hashing them again is much cheaper
+// than clearing the whole table, which matters for runs of tiny sprites.
+static void lz_context_clear(LZContext* ctx, const uint8_t* data, size_t len)
+{
+    size_t head_size = (size_t)1 << HASH_BITS;
+
+    if (len >= head_size)
+    {
+        memset(ctx->mf.head, 0, head_size * sizeof(uint32_t));
+        return;
+    }
+
+    for (size_t pos = 0; pos + MIN_LZ <= len; pos++)
+        ctx->mf.head[hash_prefix(data + pos)] = 0;
+}
+
+typedef struct
+{
+    size_t start;
+    size_t length;
+    size_t offset;
+} LdmMatch;
+
+// Walks the input once with the gear hash; ldm_next picks up where the
+// previous match ended, or at the parse position if that is further on.
+typedef struct
+{
+    const uint64_t* gear;
+    LZLdmEntry* table;
+    uint32_t table_mask;
+    int table_log;
+    const uint8_t* data;
+    size_t total;
+    size_t min_distance;
+    size_t scan;
+    size_t rolled;
+    uint64_t hash;
+} LdmScanner;
+
+// The table holds about one entry per sampled position, up to LZ_LDM_HASH_LOG.
+static int ldm_init(LdmScanner* s, LZContext* ctx, const uint8_t* data, size_t total, size_t min_distance)
+{
+    int table_log = 10;
+    while (table_log < LZ_LDM_HASH_LOG && ((size_t)1 << table_log) < (total >> LZ_LDM_RATE_LOG))
+        table_log++;
+
+    size_t table_bytes = ((size_t)1 << table_log) * sizeof(LZLdmEntry);
+    if (!lz_context_reserve(ctx, (void**)&ctx->ldm, &ctx->ldm_cap, table_bytes))
+        return 0;
+    memset(ctx->ldm, 0, table_bytes);
+
+    s->gear = ctx->gear;
+    s->table = ctx->ldm;
+    s->table_mask = ((uint32_t)1 << table_log) - 1;
+    s->table_log = table_log;
+    s->data = data;
+    s->total = total;
+    s->min_distance = min_distance;
+    s->scan = 0;
+    s->rolled = 0;
+    s->hash = 0;
+    return 1;
+}
+
+// Finds the next long match at or after from. Only matches further back
+// than min_distance count; nearer ones are the regular parser's job.
+static int ldm_next(LdmScanner* s, size_t from, LdmMatch* match)
+{
+    if (s->scan < from)
+    {
+        s->scan = from;
+        s->rolled = 0;
+        s->hash = 0;
+    }
+
+    while (s->scan < s->total)
+    {
+        s->hash = (s->hash << 1) + s->gear[s->data[s->scan]];
+        s->scan++;
+
+        // the top bits depend on all LZ_LDM_MIN_MATCH bytes, the low ones only on the last few
+        if (++s->rolled < LZ_LDM_MIN_MATCH || (s->hash >> (64 - LZ_LDM_RATE_LOG)) != 0)
+            continue;
+
+        size_t cur = s->scan - LZ_LDM_MIN_MATCH;
+        uint32_t slot = (uint32_t)(s->hash >> (64 - LZ_LDM_RATE_LOG - s->table_log)) & s->table_mask & ~(uint32_t)(LZ_LDM_BUCKET - 1);
+        uint32_t check = (uint32_t)(s->hash >> 8);
+        LZLdmEntry* bucket = s->table + slot;
+
+        size_t best_len = 0;
+        size_t best_cand = 0;
+        int oldest = 0;
+
+        for (int i = 0; i < LZ_LDM_BUCKET; i++)
+        {
+            if (bucket[i].pos < bucket[oldest].pos)
+                oldest = i;
+            if (bucket[i].pos == 0 || bucket[i].check != check)
+                continue;
+
+            size_t cand = bucket[i].pos - 1;
+            size_t distance = cur - cand;
+            if (distance <= s->min_distance || distance > LZ_LDM_MAX_DISTANCE)
+                continue;
+
+            size_t len = match_length(s->data + cand, s->data + cur, s->total - cur);
+            if (len >= LZ_LDM_MIN_MATCH && len > best_len)
+            {
+                best_len = len;
+                best_cand = cand;
+            }
+        }
+
+        bucket[oldest].pos = (uint32_t)(cur + 1);
+        bucket[oldest].check = check;
+
+        if (best_len > 0)
+        {
+            // extend backwards over bytes the regular parser has not emitted yet
+            while (cur > from && best_cand > 0 && s->data[cur - 1] == s->data[best_cand - 1])
+            {
+                cur--;
+                best_cand--;
+                best_len++;
+            }
+
+            match->start = cur;
+            match->length = best_len;
+            match->offset = cur - best_cand;
+
+            s->scan = cur + best_len;
+            s->rolled = 0;
+            s->hash = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static size_t lz_context_parse(LZContext* ctx, const uint8_t* data, size_t end, size_t start, size_t* next_insert, TokenWriter* tw)
+{
+    switch (ctx->params.parse)
+    {
+    case LZ_PARSE_GREEDY:
+        return parse_greedy(&ctx->mf, data, end, start, &ctx->params, next_insert, tw);
+    case LZ_PARSE_LAZY:
+        return parse_lazy(&ctx->mf, data, end, start, &ctx->params, next_insert, tw);
+    default:
+        return parse_optimal(&ctx->mf, data, end, start, &ctx->params, ctx->opt, next_insert, tw);
+    }
+}
+
+// A long match goes out as matches of at most max_match bytes; a tail too
+// short for a match goes out as literals.
+static int put_long_match(TokenWriter* tw, const uint8_t* data, const LdmMatch* match, const LZParams* params)
+{
+    size_t done = 0;
+    while (done < match->length)
+    {
+        size_t len = match->length - done;
+        if (len > (size_t)params->max_match)
+            len = (size_t)params->max_match;
+
+        int ok;
+        if (len >= (size_t)params->min_match)
+        {
+            ok = token_put_match(tw, (int)len, (int)match->offset);
+        }
+        else
+        {
+            ok = 1;
+            for (size_t i = 0; i < len && ok; i++)
+                ok = token_put_literal(tw, data[match->start + done + i]);
+        }
+
+        if (!ok)
+            return 0;
+        done += len;
+    }
+    return 1;
+}
+
+size_t lz_context_compress(LZContext* ctx, const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, const LZDict* dict)
+{
+    const LZParams* params = &ctx->params;
+
+    size_t header = dict ? 5 : 1;
+    if (out_cap < header)
+        return COMPRESS_ERROR;
+    if (params->min_match < MIN_LZ || params->max_match > MAX_LZ || params->max_match < params->min_match || params->chain_depth < 0)
+        return COMPRESS_ERROR;
+
+    // the dictionary goes in front of the data, so matches can reach back into it
+    size_t dict_size = dict ? dict->size : 0;
+    size_t total = dict_size + in_len;
+    const uint8_t* data = in;
+
+    if (dict_size > 0)
+    {
+        if (!lz_context_reserve(ctx, (void**)&ctx->window, &ctx->window_cap, total))
+            return COMPRESS_ERROR;
+
+        memcpy(ctx->window, dict->data, dict_size);
+        memcpy(ctx->window + dict_size, in, in_len);
+        data = ctx->window;
+    }
+
+    // no point in a window larger than the input; small blocks then need small hash chains
+    int max_log = params->window_log < LZ_WINDOW_LOG ? params->window_log : LZ_WINDOW_LOG;
+    int window_log = 10;
+    while (window_log < max_log && ((size_t)1 << window_log) < total)
+        window_log++;
+
+    if (!lz_context_prepare(ctx, window_log))
+        return COMPRESS_ERROR;
+
+    out[0] = (uint8_t)window_log;
+    if (dict)
+    {
+        out[0] |= LZ_HEADER_DICT;
+        write_u32(out + 1, dict->id);
+    }
+
+    TokenWriter tw;
+    token_writer_init(&tw, out + header, out_cap - header);
+
+    size_t pos = dict_size;
+    size_t next_insert = 0;
+    size_t max_offset = 0;
+    int ok = 1;
+
+    // long matches split the input; the regular parser handles the gaps
+    LdmScanner ldm;
+    if (params->long_distance && total > ctx->mf.window_size && ldm_init(&ldm, ctx, data, total, ctx->mf.window_size))
+    {
+        LdmMatch match;
+        while (ok && pos < total && ldm_next(&ldm, pos, &match))
+        {
+            ok = lz_context_parse(ctx, data, match.start, pos, &next_insert, &tw) == match.start
+                && put_long_match(&tw, data, &match, params);
+
+            pos = match.start + match.length;
+            if (match.offset > max_offset)
+                max_offset = match.offset;
+        }
+    }
+
+    if (ok)
+        pos = lz_context_parse(ctx, data, total, pos, &next_insert, &tw);
+
+    lz_context_clear(ctx, data, total);
+
+    if (!ok || pos < total)
+        return COMPRESS_ERROR;
+
+    // long matches can reach past the regular window; streaming decoders size their history from this
+    while (((size_t)1 << window_log) < max_offset)
+        window_log++;
+    out[0] = (uint8_t)((out[0] & ~LZ_HEADER_WINDOW_MASK) | window_log);
+
+    size_t len = header + tw.len;
+
+    // keep the Huffman coded version only when it is actually smaller
+    if (lz_context_reserve(ctx, (void**)&ctx->scratch, &ctx->scratch_cap, len))
+    {
+        size_t coded_len = entropy_encode(out, len, header, in_len, ctx->scratch, len - 1);
+        if (coded_len != COMPRESS_ERROR)
+        {
+            memcpy(out, ctx->scratch, coded_len);
+            len = coded_len;
+        }
+    }
+
+    return len;
+}
+
+size_t compress_params(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, const LZParams* params, const LZDict* dict)
+{
+    LZContext ctx;
+    lz_context_init(&ctx, LZ_LEVEL_DEFAULT, NULL);
+    ctx.params = *params;
+
+    size_t len = lz_context_compress(&ctx, in, in_len, out, out_cap, dict);
+    lz_context_free(&ctx);
+    return len;
+}
+
+size_t compress_dict(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, int level, const LZDict* dict)
+{
+    LZParams params;
+    lz_level_params(level, &params);
+    return compress_params(in, in_len, out, out_cap, &params, dict);
+}
+
+size_t compress_level(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, int level)
+{
+    return compress_dict(in, in_len, out, out_cap, level, NULL);
+}
+
+size_t compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap)
+{
+    return compress_level(in, in_len, out, out_cap, LZ_LEVEL_DEFAULT);
+}
+
+size_t lz_write_file(void* user, const uint8_t* data, size_t len)
+{
+    return fwrite(data, 1, len, (FILE*)user);
+}
+
+static void match_finder_slide(MatchFinder* mf, size_t shift)
+{
+    size_t head_size = (size_t)1 << HASH_BITS;
+
+    for (size_t i = 0; i < head_size; i++)
+        mf->head[i] = mf->head[i] > shift ? (uint32_t)(mf->head[i] - shift) : 0;
+
+    for (size_t i = 0; i <= mf->window_mask; i++)
+        mf->prev[i] = mf->prev[i] > shift ? (uint32_t)(mf->prev[i] - shift) : 0;
+}
+
+static void lz_stream_flush(LZStream* s)
+{
+    if (s->tw.len == 0 || s->error)
+        return;
+
+    if (s->write(s->user, s->tw.out, s->tw.len) != s->tw.len)
+        s->error = 1;
+
+    s->total_out += s->tw.len;
+    s->tw.len = 0;
+}
+
+int lz_stream_init(LZStream* s, int window_log, LZWriteFn write, void* user)
+{
+    memset(s, 0, sizeof(*s));
+
+    // lz_decoder_init rejects anything larger
+    if (window_log < 0 || window_log > LZ_WINDOW_LOG)
+        return 0;
+
+    s->window_size = (size_t)1 << window_log;
+    s->buffer_cap = 2 * s->window_size + LZ_STREAM_LOOKAHEAD;
+    s->buffer = (uint8_t*)LZ_MALLOC(s->buffer_cap);
+    s->write = write;
+    s->user = user;
+
+    uint8_t* out = (uint8_t*)LZ_MALLOC(LZ_STREAM_OUT_SIZE);
+
+    if (!s->buffer || !out || !match_finder_init(&s->mf, s->window_size, HASH_CHAIN_DEPTH))
+    {
+        LZ_FREE(s->buffer);
+        LZ_FREE(out);
+        s->buffer = NULL;
+        return 0;
+    }
+
+    token_writer_init(&s->tw, out, LZ_STREAM_OUT_SIZE);
+    s->tw.out[s->tw.len++] = (uint8_t)window_log;
+    return 1;
+}
+
+// Encodes everything that has a full look-ahead behind it (or everything, when final).
+static void lz_stream_encode(LZStream* s, int final)
+{
+    while (s->pos < s->end && (final || s->end - s->pos >= LZ_STREAM_LOOKAHEAD))
+    {
+        // a group (control byte + 8 items) never straddles a flush, since the control byte is patched in place
+        if (s->tw.ctrl_bit == 8 && s->tw.cap - s->tw.len < LZ_MAX_GROUP_SIZE)
+            lz_stream_flush(s);
+
+        Pair match = match_finder_find(&s->mf, s->buffer, s->end, s->pos, LZ_STREAM_LOOKAHEAD);
+
+        if (match.length >= MIN_LZ)
+        {
+            token_put_match(&s->tw, match.length, match.offset);
+
+            for (int i = 0; i < match.length; i++)
+            {
+                match_finder_insert(&s->mf, s->buffer, s->end, s->pos + i);
+            }
+            s->pos += match.length;
+        }
+        else
+        {
+            token_put_literal(&s->tw, s->buffer[s->pos]);
+            match_finder_insert(&s->mf, s->buffer, s->end, s->pos);
+            s->pos++;
+        }
+    }
+}
+
+int lz_stream_feed(LZStream* s, const uint8_t* data, size_t len)
+{
+    while (len > 0 && !s->error)
+    {
+        if (s->end == s->buffer_cap)
+        {
+            // keep one window of history; shifting by the window size keeps prev[] ring slots aligned
+            size_t shift = s->window_size;
+            memmove(s->buffer, s->buffer + shift, s->end - shift);
+            s->pos -= shift;
+            s->end -= shift;
+            match_finder_slide(&s->mf, shift);
+        }
+
+        size_t chunk = s->buffer_cap - s->end;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(s->buffer + s->end, data, chunk);
+        s->end += chunk;
+        data += chunk;
+        len -= chunk;
+
+        lz_stream_encode(s, 0);
+    }
+
+    return !s->error;
+}
+
+size_t lz_stream_finish(LZStream* s)
+{
+    lz_stream_encode(s, 1);
+    lz_stream_flush(s);
+
+    int error = s->error;
+    size_t total = s->total_out;
+
+    match_finder_free(&s->mf);
+    LZ_FREE(s->buffer);
+    LZ_FREE(s->tw.out);
+    s->buffer = NULL;
+    s->tw.out = NULL;
+
+    return error ? COMPRESS_ERROR : total;
+}
+
+uint32_t lz_stream_dict_id(const uint8_t* in, size_t in_len)
+{
+    if (in_len < 5 || !(in[0] & LZ_HEADER_DICT))
+        return 0;
+    return read_u32(in + 1);
+}
+
+size_t decompress_dict(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap, const LZDict* dict)
+{
+    if (in_len == 0)
+        return 0;
+
+    size_t ip = 1;
+    size_t dict_size = 0;
+
+    if (in[0] & LZ_HEADER_DICT)
+    {
+        if (!dict || lz_stream_dict_id(in, in_len) != dict->id)
+            return COMPRESS_ERROR;
+        ip = 5;
+        dict_size = dict->size;
+    }
+    else
+    {
+        dict = NULL;
+    }
+
+    if (in[0] & LZ_HEADER_ENTROPY)
+        return entropy_decode(in, in_len, ip, out, out_cap, dict);
+
+    size_t op = 0;
+
+    while (ip < in_len)
+    {
+        uint8_t ctrl = in[ip++];
+
+        for (int bit = 0; bit < 8 && ip < in_len; bit++)
+        {
+            if (ctrl & (1 << bit))
+            {
+                uint32_t length, offset;
+                if (!read_varint(in, in_len, &ip, &length) || !read_varint(in, in_len, &ip, &offset))
+                    return COMPRESS_ERROR;
+
+                length += MIN_LZ;
+                offset += 1;
+                if (length > MAX_LZ || offset > op + dict_size || length > out_cap - op)
+                    return COMPRESS_ERROR;
+
+                copy_dict_match(out, op, offset, length, out + out_cap, dict);
+                op += length;
+            }
+            else
+            {
+                if (op == out_cap)
+                    return COMPRESS_ERROR;
+                out[op++] = in[ip++];
+            }
+        }
+    }
+
+    return op;
+}
+
+size_t decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap)
+{
+    return decompress_dict(in, in_len, out, out_cap, NULL);
+}
+
+uint32_t lz_dict_id(const uint8_t* data, size_t size)
+{
+    // FNV-1a; 0 is kept for "no dictionary"
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+void lz_dict_init(LZDict* dict, const uint8_t* data, size_t size)
+{
+    dict->id = lz_dict_id(data, size);
+    dict->data = data;
+    dict->size = size;
+}
+
+static uint32_t hash_kmer(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, LZ_DICT_KMER);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ull) >> (64 - LZ_DICT_HASH_BITS));
+}
+
+typedef struct
+{
+    size_t start;
+    uint64_t score;
+} DictSegment;
+
+static int compare_segments(const void* a, const void* b)
+{
+    const DictSegment* x = (const DictSegment*)a;
+    const DictSegment* y = (const DictSegment*)b;
+    if (x->score != y->score)
+        return x->score < y->score ? -1 : 1;
+    return x->start < y->start ? -1 : (x->start > y->start);
+}
+
+// Cover-style training: every LZ_DICT_KMER byte string is weighted by the
+// number of samples it shows up in (minus one, a string only one sample
+// has is no use to the others). The samples are split into one epoch per
+// dictionary segment, and each epoch contributes the LZ_DICT_SEGMENT bytes
+// with the highest total weight; the strings it covers then drop to zero
+// so later epochs pick something new. The best segments go last, closest
+// to the data and so cheapest to reference.
+size_t lz_dict_train(const uint8_t* samples, const size_t* sample_sizes, int count, uint8_t* dict, size_t dict_cap)
+{
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += sample_sizes[i];
+
+    if (dict_cap > LZ_DICT_MAX_SIZE)
+        dict_cap = LZ_DICT_MAX_SIZE;
+
+    // not worth training: the samples themselves are the dictionary
+    if (total <= dict_cap)
+    {
+        memcpy(dict, samples, total);
+        return total;
+    }
+
+    size_t table_size = (size_t)1 << LZ_DICT_HASH_BITS;
+    uint32_t* weight = (uint32_t*)LZ_CALLOC(table_size, sizeof(uint32_t));
+    int* last_sample = (int*)LZ_MALLOC(table_size * sizeof(int));
+    size_t segment_count = dict_cap / LZ_DICT_SEGMENT;
+    DictSegment* segments = (DictSegment*)LZ_MALLOC((segment_count + 1) * sizeof(DictSegment));
+
+    if (!weight || !last_sample || !segments || segment_count == 0)
+    {
+        LZ_FREE(weight);
+        LZ_FREE(last_sample);
+        LZ_FREE(segments);
+        return 0;
+    }
+
+    for (size_t i = 0; i < table_size; i++)
+        last_sample[i] = -1;
+
+    size_t base = 0;
+    for (int s = 0; s < count; s++)
+    {
+        for (size_t i = 0; i + LZ_DICT_KMER <= sample_sizes[s]; i++)
+        {
+            uint32_t h = hash_kmer(samples + base + i);
+            if (last_sample[h] != s)
+            {
+                if (last_sample[h] >= 0)
+                    weight[h]++;
+                last_sample[h] = s;
+            }
+        }
+        base += sample_sizes[s];
+    }
+
+    size_t kmers = LZ_DICT_SEGMENT - LZ_DICT_KMER + 1;
+    size_t epoch_size = total / segment_count;
+    if (epoch_size < LZ_DICT_SEGMENT)
+        epoch_size = LZ_DICT_SEGMENT;
+
+    size_t picked = 0;
+    for (size_t epoch = 0; epoch + LZ_DICT_SEGMENT <= total && picked < segment_count; epoch += epoch_size)
+    {
+        size_t end = epoch + epoch_size;
+        if (end > total)
+            end = total;
+
+        // sliding sum of the weights of the kmers inside the segment
+        uint64_t score = 0;
+        for (size_t k = 0; k < kmers; k++)
+            score += weight[hash_kmer(samples + epoch + k)];
+
+        DictSegment best = { epoch, score };
+        for (size_t start = epoch + 1; start + LZ_DICT_SEGMENT <= end; start++)
+        {
+            score -= weight[hash_kmer(samples + start - 1)];
+            score += weight[hash_kmer(samples + start + kmers - 1)];
+            if (score > best.score)
+            {
+                best.start = start;
+                best.score = score;
+            }
+        }
+
+        if (best.score == 0)
+            continue;
+
+        for (size_t k = 0; k < kmers; k++)
+            weight[hash_kmer(samples + best.start + k)] = 0;
+
+        segments[picked++] = best;
+    }
+
+    qsort(segments, picked, sizeof(DictSegment), compare_segments);
+
+    size_t size = 0;
+    for (size_t i = 0; i < picked; i++)
+    {
+        memcpy(dict + size, samples + segments[i].start, LZ_DICT_SEGMENT);
+        size += LZ_DICT_SEGMENT;
+    }
+
+    LZ_FREE(weight);
+    LZ_FREE(last_sample);
+    LZ_FREE(segments);
+
+    return size;
+}
+
+size_t lz_read_file(void* user, uint8_t* data, size_t len)
+{
+    return fread(data, 1, len, (FILE*)user);
+}
+
+static int lz_decoder_fill(LZDecoder* d)
+{
+    if (d->in_eof)
+        return 0;
+
+    d->in_len = d->read(d->read_user, d->in, LZ_STREAM_IN_SIZE);
+    d->in_pos = 0;
+
+    if (d->in_len == 0)
+    {
+        d->in_eof = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int lz_decoder_more(LZDecoder* d)
+{
+    return d->in_pos < d->in_len || lz_decoder_fill(d);
+}
+
+static int lz_decoder_byte(LZDecoder* d, uint8_t* b)
+{
+    if (!lz_decoder_more(d))
+        return 0;
+
+    *b = d->in[d->in_pos++];
+    return 1;
+}
+
+static int lz_decoder_varint(LZDecoder* d, uint32_t* v)
+{
+    uint32_t result = 0;
+
+    for (int shift = 0; shift < 32; shift += 7)
+    {
+        uint8_t b;
+        if (!lz_decoder_byte(d, &b))
+            return 0;
+
+        result |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            *v = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// History is full: hand the undelivered bytes to the sink and keep one window for back-references.
+static int lz_decoder_make_room(LZDecoder* d, LZSinkFn sink, void* user)
+{
+    if (!sink(user, d->history + d->flushed, d->hist_len - d->flushed))
+        return 0;
+
+    size_t shift = d->hist_len - d->window_size;
+    memmove(d->history, d->history + shift, d->window_size);
+    d->hist_len = d->window_size;
+    d->flushed = d->window_size;
+    return 1;
+}
+
+int lz_decoder_init(LZDecoder* d, LZReadFn read, void* user)
+{
+    memset(d, 0, sizeof(*d));
+    d->read = read;
+    d->read_user = user;
+
+    d->in = (uint8_t*)LZ_MALLOC(LZ_STREAM_IN_SIZE);
+    if (!d->in)
+        return 0;
+
+    // no encoder writes a larger window, so a corrupt byte cannot ask for a huge history
+    uint8_t window_log;
+    if (!lz_decoder_byte(d, &window_log) || window_log > LZ_WINDOW_LOG)
+    {
+        lz_decoder_free(d);
+        return 0;
+    }
+
+    d->window_size = (size_t)1 << window_log;
+    d->history_cap = d->window_size + LZ_DECODE_CHUNK;
+    d->history = (uint8_t*)LZ_MALLOC(d->history_cap);
+    if (!d->history)
+    {
+        lz_decoder_free(d);
+        return 0;
+    }
+    return 1;
+}
+
+size_t lz_decoder_run(LZDecoder* d, LZSinkFn sink, void* user)
+{
+    uint8_t ctrl;
+
+    while (lz_decoder_byte(d, &ctrl))
+    {
+        for (int bit = 0; bit < 8 && lz_decoder_more(d); bit++)
+        {
+            if (ctrl & (1 << bit))
+            {
+                uint32_t length, offset;
+                if (!lz_decoder_varint(d, &length) || !lz_decoder_varint(d, &offset))
+                    return COMPRESS_ERROR;
+
+                // a slide in the middle of the match leaves only one window of
+                // history, so longer offsets would reach before the buffer
+                length += MIN_LZ;
+                offset += 1;
+                if (length > MAX_LZ || offset > d->hist_len || offset > d->window_size)
+                    return COMPRESS_ERROR;
+
+                d->total += length;
+
+                while (length > 0)
+                {
+                    if (d->hist_len == d->history_cap && !lz_decoder_make_room(d, sink, user))
+                        return COMPRESS_ERROR;
+
+                    size_t n = d->history_cap - d->hist_len;
+                    if (n > length)
+                        n = length;
+
+                    copy_match(d->history + d->hist_len, offset, n, d->history + d->history_cap);
+
+                    d->hist_len += n;
+                    length -= (uint32_t)n;
+                }
+            }
+            else
+            {
+                if (d->hist_len == d->history_cap && !lz_decoder_make_room(d, sink, user))
+                    return COMPRESS_ERROR;
+
+                d->history[d->hist_len++] = d->in[d->in_pos++];
+                d->total++;
+            }
+        }
+    }
+
+    if (d->hist_len > d->flushed && !sink(user, d->history + d->flushed, d->hist_len - d->flushed))
+        return COMPRESS_ERROR;
+
+    d->flushed = d->hist_len;
+    return d->total;
+}
+
+void lz_decoder_free(LZDecoder* d)
+{
+    LZ_FREE(d->in);
+    LZ_FREE(d->history);
+    d->in = NULL;
+    d->history = NULL;
+}
+
+int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+int cpu_has_ssse3(void)
+{
+#if defined(LZ_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#elif defined(LZ_X86)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#else
+    return 0;
+#endif
+}
+
+typedef struct
+{
+    void (*fn)(void* ctx, int index);
+    void (*worker_fn)(void* ctx, int index, int worker);
+    void* ctx;
+    int start;
+    int step;
+    int count;
+} WorkerArgs;
+
+static void run_worker(WorkerArgs* w)
+{
+    for (int i = w->start; i < w->count; i += w->step)
+    {
+        if (w->worker_fn)
+            w->worker_fn(w->ctx, i, w->start);
+        else
+            w->fn(w->ctx, i);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg)
+{
+    run_worker((WorkerArgs*)arg);
+    return 0;
+}
+#else
+static void* worker_main(void* arg)
+{
+    run_worker((WorkerArgs*)arg);
+    return NULL;
+}
+#endif
+
+int parallel_workers(int count, int threads)
+{
+    if (threads <= 0)
+        threads = cpu_count();
+    if (threads > count)
+        threads = count;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    return threads;
+}
+
+static void parallel_run(int count, int threads, void (*fn)(void* ctx, int index), void (*worker_fn)(void* ctx, int index, int worker), void* ctx)
+{
+    threads = parallel_workers(count, threads);
+
+    WorkerArgs args[MAX_THREADS];
+    int started[MAX_THREADS] = {0};
+
+#ifdef _WIN32
+    HANDLE handles[MAX_THREADS];
+#else
+    pthread_t handles[MAX_THREADS];
+#endif
+
+    for (int t = 0; t < threads; t++)
+    {
+        args[t].fn = fn;
+        args[t].worker_fn = worker_fn;
+        args[t].ctx = ctx;
+        args[t].start = t;
+        args[t].step = threads;
+        args[t].count = count;
+    }
+
+    // worker 0 runs on the calling thread; a worker that fails to start also runs here
+    for (int t = 1; t < threads; t++)
+    {
+#ifdef _WIN32
+        handles[t] = CreateThread(NULL, 0, worker_main, &args[t], 0, NULL);
+        started[t] = handles[t] != NULL;
+#else
+        started[t] = pthread_create(&handles[t], NULL, worker_main, &args[t]) == 0;
+#endif
+    }
+
+    for (int t = 0; t < threads; t++)
+    {
+        if (!started[t])
+            run_worker(&args[t]);
+    }
+
+    for (int t = 1; t < threads; t++)
+    {
+        if (!started[t])
+            continue;
+#ifdef _WIN32
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+#else
+        pthread_join(handles[t], NULL);
+#endif
+    }
+}
+
+void parallel_for(int count, int threads, void (*fn)(void* ctx, int index), void* ctx)
+{
+    parallel_run(count, threads, fn, NULL, ctx);
+}
+
+void parallel_for_workers(int count, int threads, void (*fn)(void* ctx, int index, int worker), void* ctx)
+{
+    parallel_run(count, threads, NULL, fn, ctx);
+}
@@ -0,0 +1,1738 @@
+#include "him_file.h"
+#include "compressor.h"
+#include "pixel_codec.h"
+
+#include <limits.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define HEX_TOKEN_LEN PIXEL_HEX_TOKEN
+
+// the savers write a row or a block at a time; this keeps those to few large writes
+#define SAVE_BUFFER_SIZE (1 << 20)
+
+static size_t hex_text_size(int width, int height)
+{
+    return (size_t)width * (size_t)height * HEX_TOKEN_LEN + (size_t)height;
+}
+
+static void format_hex_row(const uint8_t* rgba, int width, char* text)
+{
+    pixel_hex_encode(rgba, (size_t)width, (uint8_t*)text);
+    text[(size_t)width * HEX_TOKEN_LEN] = '\n';
+}
+
+// Turns decoded hex text into pixel rows as it arrives; a token may be split
+// across chunks. Digits are folded into the pixel value as they are read,
+// the way strtoul reads "0x" tokens: the value ends at the first non-hex
+// character and the rest of the token is skipped.
+typedef struct
+{
+    const HimSink* sink;
+    int width;
+    int height;
+    int x;
+    int y;
+    uint8_t* row;
+    uint32_t value;
+    int token_len;
+    int stopped;
+} HexRowParser;
+
+// digit value + 1, 0 for anything that is not a hex digit
+static const uint8_t hex_digit[256] =
+{
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+static void hex_parser_token(HexRowParser* p)
+{
+    uint32_t hex = p->value;
+    p->value = 0;
+    p->token_len = 0;
+    p->stopped = 0;
+
+    if (p->y >= p->height)
+        return;
+
+    uint8_t* c = p->row + (size_t)p->x * 4;
+    c[0] = (hex >> 24) & 0xFF;
+    c[1] = (hex >> 16) & 0xFF;
+    c[2] = (hex >> 8) & 0xFF;
+    c[3] = hex & 0xFF;
+
+    if (++p->x == p->width)
+    {
+        p->sink->write_span(p->sink->user, 0, p->y, p->width, p->row);
+        p->x = 0;
+        p->y++;
+    }
+}
+
+static int hex_parser_feed(void* user, const uint8_t* data, size_t len)
+{
+    HexRowParser* p = (HexRowParser*)user;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        uint8_t ch = data[i];
+
+        // runs of whole "0xRRGGBBAA" tokens, which is nearly all of the text, skip the state machine
+        if (p->token_len == 0 && ch == '0' && p->y < p->height)
+        {
+            size_t used;
+            size_t n = pixel_hex_decode(data + i, len - i, p->row + (size_t)p->x * 4, (size_t)(p->width - p->x), &used);
+
+            p->x += (int)n;
+            if (p->x == p->width)
+            {
+                p->sink->write_span(p->sink->user, 0, p->y, p->width, p->row);
+                p->x = 0;
+                p->y++;
+            }
+
+            if (used > 0)
+            {
+                i += used - 1;
+                continue;
+            }
+        }
+
+        if (ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t')
+        {
+            if (p->token_len > 0)
+                hex_parser_token(p);
+            continue;
+        }
+
+        int digit = hex_digit[ch];
+        if ((ch == 'x' || ch == 'X') && p->token_len == 1 && p->value == 0)
+            digit = 1;
+        else if (digit == 0)
+            p->stopped = 1;
+        else if (!p->stopped)
+            p->value = (p->value << 4) | (uint32_t)(digit - 1);
+
+        p->token_len++;
+    }
+    return 1;
+}
+
+static int hex_parser_finish(HexRowParser* p, const char* filename)
+{
+    if (p->token_len > 0)
+        hex_parser_token(p);
+
+    if (p->y < p->height)
+    {
+        printf("load_pixels: truncated data '%s'\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+static void put_u16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static uint16_t get_u16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_u64(const uint8_t* p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static int block_rows(int width)
+{
+    size_t band = (size_t)HIM_BLOCK_ROWS * ((size_t)width * HEX_TOKEN_LEN + 1);
+    size_t bands = (HIM_BLOCK_TARGET + band - 1) / band;
+    return (int)bands * HIM_BLOCK_ROWS;
+}
+
+static size_t save_lz_stream(FILE* fout, int width, int height, const HimSource* src)
+{
+    size_t row_text_len = (size_t)width * HEX_TOKEN_LEN + 1;
+    uint8_t* row = (uint8_t*)malloc((size_t)width * 4);
+    char* row_text = (char*)malloc(row_text_len + 1);
+
+    LZStream stream;
+    if (!row || !row_text || !lz_stream_init(&stream, LZ_STREAM_WINDOW_LOG, lz_write_file, fout))
+    {
+        free(row);
+        free(row_text);
+        return COMPRESS_ERROR;
+    }
+
+    int ok = 1;
+    for (int y = 0; y < height && ok; y++)
+    {
+        src->read_span(src->user, 0, y, width, row);
+        format_hex_row(row, width, row_text);
+        ok = lz_stream_feed(&stream, (const uint8_t*)row_text, row_text_len);
+    }
+
+    size_t clen = lz_stream_finish(&stream);
+    free(row);
+    free(row_text);
+
+    return ok ? clen : COMPRESS_ERROR;
+}
+
+// One per save worker, kept for the whole save: the compressor's tables and
+// the input buffer are sized for the largest block up front, so no block
+// after a worker's first allocates anything.
+typedef struct
+{
+    LZContext lz;
+    uint8_t* row;
+    uint8_t* in;
+} SaveWorker;
+
+static void save_workers_free(SaveWorker* workers, int count)
+{
+    if (!workers)
+        return;
+
+    for (int i = 0; i < count; i++)
+    {
+        lz_context_free(&workers[i].lz);
+        free(workers[i].row);
+        free(workers[i].in);
+    }
+    free(workers);
+}
+
+static SaveWorker* save_workers_new(int count, int level, size_t row_len, size_t in_cap)
+{
+    SaveWorker* workers = (SaveWorker*)calloc((size_t)(count > 0 ? count : 1), sizeof(SaveWorker));
+    if (!workers)
+        return NULL;
+
+    int ok = 1;
+    for (int i = 0; i < count; i++)
+    {
+        SaveWorker* w = &workers[i];
+        lz_context_init(&w->lz, level, NULL);
+        w->row = row_len ? (uint8_t*)malloc(row_len) : NULL;
+        w->in = (uint8_t*)malloc(in_cap ? in_cap : 1);
+        ok = ok && (w->row || !row_len) && w->in;
+    }
+
+    if (!ok)
+    {
+        save_workers_free(workers, count);
+        return NULL;
+    }
+    return workers;
+}
+
+// Blocks are compressed a wave at a time, one block per worker, into the
+// wave's slots, and each wave is written out in order before the next
+// starts. A save holds one wave of compressed blocks however large the
+// canvas is.
+typedef struct
+{
+    int base; // block index of slot 0
+    int slots;
+    uint8_t* out;
+    size_t out_cap;
+    size_t* sizes;
+} SaveWave;
+
+static int save_wave_init(SaveWave* wave, int slots, size_t in_cap)
+{
+    wave->base = 0;
+    wave->slots = slots;
+    wave->out_cap = compress_bound(in_cap);
+    wave->out = (uint8_t*)malloc(wave->out_cap * (size_t)slots);
+    wave->sizes = (size_t*)malloc((size_t)slots * sizeof(size_t));
+    return wave->out && wave->sizes;
+}
+
+static void save_wave_free(SaveWave* wave)
+{
+    free(wave->out);
+    free(wave->sizes);
+}
+
+static void save_worker_compress(SaveWorker* w, SaveWave* wave, int slot, size_t len, const LZDict* dict)
+{
+    wave->sizes[slot] = lz_context_compress(&w->lz, w->in, len, wave->out + (size_t)slot * wave->out_cap, wave->out_cap, dict);
+}
+
+// u32 count, u32 param, the entry table, then the blocks back to back. The
+// table goes out zeroed and is filled in once every block's size is known;
+// fn(ctx, slot, worker) compresses block wave->base + slot.
+static size_t save_blocks(FILE* fout, uint32_t param, int count, int threads, SaveWave* wave, void (*fn)(void* ctx, int slot, int worker), void* ctx)
+{
+    size_t table_len = 8 + (size_t)count * HIM_BLOCK_ENTRY_SIZE;
+    uint8_t* table = (uint8_t*)calloc(table_len, 1);
+    if (!table)
+        return COMPRESS_ERROR;
+
+    put_u32(table, (uint32_t)count);
+    put_u32(table + 4, param);
+
+    int ok = fwrite(table, 1, table_len, fout) == table_len;
+    uint64_t offset = 0;
+
+    for (wave->base = 0; wave->base < count && ok; wave->base += wave->slots)
+    {
+        int n = count - wave->base < wave->slots ? count - wave->base : wave->slots;
+        parallel_for_workers(n, threads, fn, ctx);
+
+        for (int i = 0; i < n && ok; i++)
+        {
+            size_t size = wave->sizes[i];
+            ok = size != COMPRESS_ERROR && fwrite(wave->out + (size_t)i * wave->out_cap, 1, size, fout) == size;
+
+            uint8_t* entry = table + 8 + (size_t)(wave->base + i) * HIM_BLOCK_ENTRY_SIZE;
+            put_u64(entry, offset);
+            put_u32(entry + 8, (uint32_t)size);
+            offset += size;
+        }
+    }
+
+    // the payload starts right after the file header, and the table with it
+    ok = ok && fseek(fout, HIM_HEADER_SIZE, SEEK_SET) == 0 && fwrite(table, 1, table_len, fout) == table_len;
+    free(table);
+
+    return ok ? table_len + (size_t)offset : COMPRESS_ERROR;
+}
+
+typedef struct
+{
+    const HimSource* src;
+    int width;
+    int height;
+    int rows_per_block;
+    const LZDict* dict;
+    SaveWorker* workers;
+    SaveWave wave;
+} BlockJob;
+
+static void compress_block(void* ctx, int slot, int worker)
+{
+    BlockJob* job = (BlockJob*)ctx;
+    SaveWorker* w = &job->workers[worker];
+
+    int y0 = (job->wave.base + slot) * job->rows_per_block;
+    int y1 = y0 + job->rows_per_block;
+    if (y1 > job->height)
+        y1 = job->height;
+
+    size_t row_text_len = (size_t)job->width * HEX_TOKEN_LEN + 1;
+    for (int y = y0; y < y1; y++)
+    {
+        job->src->read_span(job->src->user, 0, y, job->width, w->row);
+        format_hex_row(w->row, job->width, (char*)w->in + (size_t)(y - y0) * row_text_len);
+    }
+
+    save_worker_compress(w, &job->wave, slot, row_text_len * (size_t)(y1 - y0), job->dict);
+}
+
+static size_t save_lz_blocks(FILE* fout, int width, int height, const HimSource* src, const HimSaveOptions* options)
+{
+    BlockJob job;
+    job.src = src;
+    job.dict = options->dict;
+    job.width = width;
+    job.height = height;
+    job.rows_per_block = block_rows(width);
+
+    int count = (height + job.rows_per_block - 1) / job.rows_per_block;
+    int workers = parallel_workers(count, options->threads);
+    size_t rows = (size_t)(height < job.rows_per_block ? height : job.rows_per_block);
+    size_t in_cap = ((size_t)width * HEX_TOKEN_LEN + 1) * rows;
+
+    job.workers = save_workers_new(workers, options->level, (size_t)width * 4, in_cap);
+    int have_wave = save_wave_init(&job.wave, workers, in_cap);
+
+    size_t total = COMPRESS_ERROR;
+    if (job.workers && have_wave)
+        total = save_blocks(fout, (uint32_t)job.rows_per_block, count, options->threads, &job.wave, compress_block, &job);
+
+    save_workers_free(job.workers, workers);
+    save_wave_free(&job.wave);
+    return total;
+}
+
+typedef struct
+{
+    const HimSource* src;
+    int width;
+    int height;
+    int cells_x;
+    SaveWorker* workers;
+    SaveWave wave;
+} ChunkJob;
+
+static void compress_chunk(void* ctx, int slot, int worker)
+{
+    ChunkJob* job = (ChunkJob*)ctx;
+    SaveWorker* w = &job->workers[worker];
+
+    int index = job->wave.base + slot;
+    int x0 = (index % job->cells_x) * HIM_CHUNK_SIZE;
+    int y0 = (index / job->cells_x) * HIM_CHUNK_SIZE;
+    int cw = job->width - x0 < HIM_CHUNK_SIZE ? job->width - x0 : HIM_CHUNK_SIZE;
+    int ch = job->height - y0 < HIM_CHUNK_SIZE ? job->height - y0 : HIM_CHUNK_SIZE;
+
+    for (int y = 0; y < ch; y++)
+        job->src->read_span(job->src->user, x0, y0 + y, cw, w->in + (size_t)y * cw * 4);
+
+    save_worker_compress(w, &job->wave, slot, (size_t)cw * (size_t)ch * 4, NULL);
+}
+
+static size_t save_chunks(FILE* fout, int width, int height, const HimSource* src, const HimSaveOptions* options)
+{
+    ChunkJob job;
+    job.src = src;
+    job.width = width;
+    job.height = height;
+    job.cells_x = (width + HIM_CHUNK_SIZE - 1) / HIM_CHUNK_SIZE;
+
+    int count = job.cells_x * ((height + HIM_CHUNK_SIZE - 1) / HIM_CHUNK_SIZE);
+    int workers = parallel_workers(count, options->threads);
+    size_t side_x = (size_t)(width < HIM_CHUNK_SIZE ? width : HIM_CHUNK_SIZE);
+    size_t side_y = (size_t)(height < HIM_CHUNK_SIZE ? height : HIM_CHUNK_SIZE);
+    size_t in_cap = side_x * side_y * 4;
+
+    job.workers = save_workers_new(workers, options->level, 0, in_cap);
+    int have_wave = save_wave_init(&job.wave, workers, in_cap);
+
+    size_t total = COMPRESS_ERROR;
+    if (job.workers && have_wave)
+        total = save_blocks(fout, HIM_CHUNK_SIZE, count, options->threads, &job.wave, compress_chunk, &job);
+
+    save_workers_free(job.workers, workers);
+    save_wave_free(&job.wave);
+    return total;
+}
+
+static size_t save_pixel_codec(FILE* fout, int width, int height, const HimSource* src)
+{
+    uint8_t* row = (uint8_t*)malloc((size_t)width * 4);
+    uint8_t* out = (uint8_t*)malloc(pixel_row_bound(width));
+
+    PixelEncoder enc;
+    if (!row || !out || !pixel_encoder_init(&enc, width))
+    {
+        free(row);
+        free(out);
+        return COMPRESS_ERROR;
+    }
+
+    size_t total = 0;
+    for (int y = 0; y < height && total != COMPRESS_ERROR; y++)
+    {
+        src->read_span(src->user, 0, y, width, row);
+        size_t n = pixel_encode_row(&enc, row, out);
+        total = fwrite(out, 1, n, fout) == n ? total + n : COMPRESS_ERROR;
+    }
+
+    if (total != COMPRESS_ERROR)
+    {
+        size_t n = pixel_encode_finish(&enc, out);
+        total = fwrite(out, 1, n, fout) == n ? total + n : COMPRESS_ERROR;
+    }
+
+    pixel_encoder_free(&enc);
+    free(row);
+    free(out);
+    return total;
+}
+
+static int build_palette(int width, int height, const HimSource* src, PixelPalette* palette)
+{
+    uint8_t* row = (uint8_t*)malloc((size_t)width * 4);
+    int ok = row != NULL;
+
+    pixel_palette_init(palette);
+    for (int y = 0; y < height && ok; y++)
+    {
+        src->read_span(src->user, 0, y, width, row);
+        ok = pixel_palette_add_row(palette, row, width);
+    }
+
+    free(row);
+    return ok;
+}
+
+static size_t save_indexed(FILE* fout, int width, int height, const HimSource* src, const HimSaveOptions* options, const PixelPalette* palette)
+{
+    int bits = pixel_palette_bits(palette);
+    size_t row_len = pixel_packed_row_size(width, bits);
+    size_t plane_len = row_len * (size_t)height;
+
+    uint8_t* row = (uint8_t*)malloc((size_t)width * 4);
+    uint8_t* plane = (uint8_t*)malloc(plane_len);
+    size_t cap = compress_bound(plane_len);
+    uint8_t* out = (uint8_t*)malloc(cap);
+
+    size_t head_len = 2 + (size_t)palette->count * 4 + 1;
+    uint8_t head[2 + PIXEL_PALETTE_MAX * 4 + 1];
+    size_t total = COMPRESS_ERROR;
+
+    if (row && plane && out)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            src->read_span(src->user, 0, y, width, row);
+            pixel_pack_row(palette, row, width, bits, plane + (size_t)y * row_len);
+        }
+
+        size_t clen = compress_level(plane, plane_len, out, cap, options->level);
+
+        head[0] = (uint8_t)palette->count;
+        head[1] = (uint8_t)(palette->count >> 8);
+        for (int i = 0; i < palette->count; i++)
+        {
+            uint32_t c = palette->colors[i];
+            head[2 + i * 4] = (uint8_t)c;
+            head[3 + i * 4] = (uint8_t)(c >> 8);
+            head[4 + i * 4] = (uint8_t)(c >> 16);
+            head[5 + i * 4] = (uint8_t)(c >> 24);
+        }
+        head[head_len - 1] = (uint8_t)bits;
+
+        if (clen != COMPRESS_ERROR && fwrite(head, 1, head_len, fout) == head_len && fwrite(out, 1, clen, fout) == clen)
+            total = head_len + clen;
+    }
+
+    free(row);
+    free(plane);
+    free(out);
+    return total;
+}
+
+static size_t tile_index_size(int count)
+{
+    return count <= 65536 ? 2 : 4;
+}
+
+static size_t save_tiles(FILE* fout, int width, int height, const HimSource* src, const HimSaveOptions* options)
+{
+    int cells_x = (width + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE;
+    int cells_y = (height + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE;
+    size_t cells = (size_t)cells_x * (size_t)cells_y;
+    size_t band_stride = (size_t)cells_x * PIXEL_TILE_SIZE * 4;
+
+    // rows are read into a band padded out to whole tiles
+    uint8_t* band = (uint8_t*)calloc(band_stride, PIXEL_TILE_SIZE);
+    uint8_t* tile = (uint8_t*)malloc(PIXEL_TILE_BYTES);
+    uint32_t* map = (uint32_t*)malloc(cells * sizeof(uint32_t));
+
+    PixelTileSet set;
+    int have_set = band && tile && map && pixel_tiles_init(&set);
+    int ok = have_set;
+
+    for (int cy = 0; cy < cells_y && ok; cy++)
+    {
+        for (int r = 0; r < PIXEL_TILE_SIZE; r++)
+        {
+            int y = cy * PIXEL_TILE_SIZE + r;
+            if (y < height)
+                src->read_span(src->user, 0, y, width, band + (size_t)r * band_stride);
+            else
+                memset(band + (size_t)r * band_stride, 0, (size_t)width * 4);
+        }
+
+        for (int cx = 0; cx < cells_x && ok; cx++)
+        {
+            for (int r = 0; r < PIXEL_TILE_SIZE; r++)
+                memcpy(tile + r * PIXEL_TILE_SIZE * 4, band + (size_t)r * band_stride + (size_t)cx * PIXEL_TILE_SIZE * 4, PIXEL_TILE_SIZE * 4);
+
+            int index = pixel_tiles_add(&set, tile);
+            map[(size_t)cy * cells_x + cx] = (uint32_t)index;
+            ok = index >= 0;
+        }
+    }
+
+    free(band);
+    free(tile);
+
+    size_t total = COMPRESS_ERROR;
+    uint8_t* plane = NULL;
+    uint8_t* out = NULL;
+
+    if (ok)
+    {
+        size_t index_size = tile_index_size(set.count);
+        size_t map_len = cells * index_size;
+        size_t plane_len = map_len + (size_t)set.count * PIXEL_TILE_BYTES;
+
+        plane = (uint8_t*)malloc(plane_len);
+        size_t cap = compress_bound(plane_len);
+        out = (uint8_t*)malloc(cap);
+
+        if (plane && out)
+        {
+            for (size_t i = 0; i < cells; i++)
+            {
+                if (index_size == 2)
+                {
+                    plane[i * 2] = (uint8_t)map[i];
+                    plane[i * 2 + 1] = (uint8_t)(map[i] >> 8);
+                }
+                else
+                {
+                    put_u32(plane + i * 4, map[i]);
+                }
+            }
+            memcpy(plane + map_len, set.tiles, (size_t)set.count * PIXEL_TILE_BYTES);
+
+            size_t clen = compress_level(plane, plane_len, out, cap, options->level);
+
+            uint8_t head[4];
+            put_u32(head, (uint32_t)set.count);
+
+            if (clen != COMPRESS_ERROR && fwrite(head, 1, 4, fout) == 4 && fwrite(out, 1, clen, fout) == clen)
+                total = 4 + clen;
+        }
+    }
+
+    if (have_set)
+        pixel_tiles_free(&set);
+    free(map);
+    free(plane);
+    free(out);
+    return total;
+}
+
+static size_t save_raw(FILE* fout, int width, int height, const HimSource* src)
+{
+    size_t row_len = (size_t)width * 4;
+    uint8_t* row = (uint8_t*)malloc(row_len);
+    if (!row)
+        return COMPRESS_ERROR;
+
+    int ok = 1;
+    for (int y = 0; y < height && ok; y++)
+    {
+        src->read_span(src->user, 0, y, width, row);
+        ok = fwrite(row, 1, row_len, fout) == row_len;
+    }
+
+    free(row);
+    return ok ? row_len * (size_t)height : COMPRESS_ERROR;
+}
+
+static int write_header(FILE* fout, int width, int height, int format, uint64_t payload_len)
+{
+    uint8_t header[HIM_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+
+    memcpy(header, HIM_MAGIC, 4);
+    put_u16(header + 4, HIM_VERSION);
+    put_u16(header + 6, HIM_HEADER_SIZE);
+    put_u32(header + 8, (uint32_t)width);
+    put_u32(header + 12, (uint32_t)height);
+    header[16] = HIM_PIXEL_RGBA8;
+    header[17] = (uint8_t)format;
+    put_u64(header + 20, (uint64_t)width * (uint64_t)height * 4);
+    put_u64(header + 28, payload_len);
+
+    return fwrite(header, 1, sizeof(header), fout) == sizeof(header);
+}
+
+static const HimSaveOptions default_save_options = { HIM_FORMAT_LATEST, 0, LZ_LEVEL_DEFAULT, NULL };
+
+int him_save(const char* filename, int width, int height, const HimSource* src, const HimSaveOptions* options)
+{
+    if (!options)
+        options = &default_save_options;
+
+    FILE* fout = fopen(filename, "wb");
+    if (!fout)
+    {
+        printf("save_pixels: failed to open '%s'\n", filename);
+        return 0;
+    }
+    setvbuf(fout, NULL, _IOFBF, SAVE_BUFFER_SIZE);
+
+    // dictionaries are trained on hex text, which only the block format compresses
+    int format = options->dict ? HIM_FORMAT_LZ_BLOCKS : options->format;
+    PixelPalette palette;
+    if (format == HIM_FORMAT_INDEXED && !build_palette(width, height, src, &palette))
+        format = HIM_FORMAT_PIXELS;
+
+    // the payload size is filled in once the payload is written
+    size_t clen;
+    if (!write_header(fout, width, height, format, 0))
+        clen = COMPRESS_ERROR;
+    else if (format == HIM_FORMAT_LZ)
+        clen = save_lz_stream(fout, width, height, src);
+    else if (format == HIM_FORMAT_LZ_BLOCKS)
+        clen = save_lz_blocks(fout, width, height, src, options);
+    else if (format == HIM_FORMAT_PIXELS)
+        clen = save_pixel_codec(fout, width, height, src);
+    else if (format == HIM_FORMAT_INDEXED)
+        clen = save_indexed(fout, width, height, src, options, &palette);
+    else if (format == HIM_FORMAT_TILES)
+        clen = save_tiles(fout, width, height, src, options);
+    else if (format == HIM_FORMAT_RAW)
+        clen = save_raw(fout, width, height, src);
+    else if (format == HIM_FORMAT_CHUNKS)
+        clen = save_chunks(fout, width, height, src, options);
+    else
+        clen = COMPRESS_ERROR;
+
+    // the savers count what they wrote; ftell's long is 32 bits on Windows
+    if (clen != COMPRESS_ERROR && (fseek(fout, 0, SEEK_SET) != 0 || !write_header(fout, width, height, format, (uint64_t)clen)))
+        clen = COMPRESS_ERROR;
+
+    if (fclose(fout) != 0)
+        clen = COMPRESS_ERROR;
+
+    if (clen == COMPRESS_ERROR)
+    {
+        printf("save_pixels: write failed '%s'\n", filename);
+        return 0;
+    }
+
+    printf("save_pixels: wrote '%s' (%zu bytes payload)\n", filename, clen);
+    return 1;
+}
+
+typedef struct
+{
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+} MemReader;
+
+static size_t mem_read(void* user, uint8_t* data, size_t len)
+{
+    MemReader* r = (MemReader*)user;
+    if (len > r->len - r->pos)
+        len = r->len - r->pos;
+
+    memcpy(data, r->data + r->pos, len);
+    r->pos += len;
+    return len;
+}
+
+static int load_lz_stream(const uint8_t* payload, size_t payload_len, HexRowParser* parser)
+{
+    MemReader reader = { payload, payload_len, 0 };
+
+    LZDecoder decoder;
+    if (!lz_decoder_init(&decoder, mem_read, &reader))
+        return 0;
+
+    int ok = lz_decoder_run(&decoder, hex_parser_feed, parser) != COMPRESS_ERROR;
+    lz_decoder_free(&decoder);
+    return ok;
+}
+
+typedef struct
+{
+    const HimSink* sink;
+    int width;
+    int height;
+    uint32_t rows_per_block;
+    const uint8_t* table;
+    const uint8_t* payload;
+    const char* filename;
+    int* ok;
+} BlockLoadJob;
+
+static void decompress_block(void* ctx, int index)
+{
+    BlockLoadJob* job = (BlockLoadJob*)ctx;
+    const uint8_t* entry = job->table + (size_t)index * HIM_BLOCK_ENTRY_SIZE;
+
+    // each block parses its own band of rows, so blocks never touch the same canvas row
+    HexRowParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.sink = job->sink;
+    parser.width = job->width;
+    parser.y = index * (int)job->rows_per_block;
+    parser.height = parser.y + (int)job->rows_per_block;
+    if (parser.height > job->height)
+        parser.height = job->height;
+
+    size_t text_cap = ((size_t)job->width * HEX_TOKEN_LEN + 1) * (size_t)(parser.height - parser.y);
+    uint8_t* text = (uint8_t*)malloc(text_cap);
+    parser.row = (uint8_t*)malloc((size_t)job->width * 4);
+
+    const uint8_t* block = job->payload + get_u64(entry);
+    size_t block_len = get_u32(entry + 8);
+
+    uint32_t dict_id = lz_stream_dict_id(block, block_len);
+    const LZDict* dict = dict_id ? him_find_dict(dict_id) : NULL;
+
+    int ok = 0;
+    if (dict_id && !dict)
+    {
+        printf("load_pixels: '%s' needs dictionary %08X\n", job->filename, dict_id);
+    }
+    else if (text && parser.row)
+    {
+        size_t n = decompress_dict(block, block_len, text, text_cap, dict);
+        ok = n != COMPRESS_ERROR && hex_parser_feed(&parser, text, n) && hex_parser_finish(&parser, job->filename);
+    }
+
+    free(text);
+    free(parser.row);
+    job->ok[index] = ok;
+}
+
+// Checks a write_block_table payload against its size: every entry has to
+// point inside the blocks that follow the table.
+static int read_block_table(const uint8_t* payload, size_t payload_len, uint32_t* count, uint32_t* param, const uint8_t** table, const uint8_t** blocks)
+{
+    if (payload_len < 8)
+        return 0;
+
+    *count = get_u32(payload);
+    *param = get_u32(payload + 4);
+
+    size_t table_len = (size_t)*count * HIM_BLOCK_ENTRY_SIZE;
+    if (table_len > payload_len - 8)
+        return 0;
+
+    *table = payload + 8;
+    *blocks = *table + table_len;
+    size_t blocks_len = payload_len - 8 - table_len;
+
+    for (uint32_t i = 0; i < *count; i++)
+    {
+        const uint8_t* entry = *table + (size_t)i * HIM_BLOCK_ENTRY_SIZE;
+        uint64_t offset = get_u64(entry);
+        if (offset > blocks_len || get_u32(entry + 8) > blocks_len - offset)
+            return 0;
+    }
+    return 1;
+}
+
+static int load_lz_blocks(const uint8_t* payload, size_t payload_len, HexRowParser* parser, const char* filename)
+{
+    uint32_t count;
+    uint32_t rows_per_block;
+    const uint8_t* table;
+    const uint8_t* blocks;
+
+    if (!read_block_table(payload, payload_len, &count, &rows_per_block, &table, &blocks))
+        return 0;
+
+    if (rows_per_block == 0 || rows_per_block > INT_MAX || count != ((uint32_t)parser->height + rows_per_block - 1) / rows_per_block)
+        return 0;
+
+    int* block_ok = (int*)calloc(count, sizeof(int));
+    if (!block_ok)
+        return 0;
+
+    BlockLoadJob job;
+    job.sink = parser->sink;
+    job.width = parser->width;
+    job.height = parser->height;
+    job.rows_per_block = rows_per_block;
+    job.table = table;
+    job.payload = blocks;
+    job.filename = filename;
+    job.ok = block_ok;
+
+    parallel_for((int)count, 0, decompress_block, &job);
+
+    int ok = 1;
+    for (uint32_t i = 0; i < count; i++)
+        ok = ok && block_ok[i];
+
+    // the blocks covered every row, so the caller's parser has nothing left to check
+    if (ok)
+        parser->y = parser->height;
+
+    free(block_ok);
+    return ok;
+}
+
+typedef struct
+{
+    const HimSink* sink;
+    int width;
+    int height;
+    int chunk_size;
+    int cells_x;
+    HimRegion region;
+    const uint8_t* table;
+    const uint8_t* chunks;
+    int* ok;
+} ChunkLoadJob;
+
+// One row of chunks: the chunks the region touches are decoded one at a time
+// and their overlap gathered into a band of region rows, so bands never share
+// a canvas row.
+static void decompress_chunk_band(void* ctx, int index)
+{
+    ChunkLoadJob* job = (ChunkLoadJob*)ctx;
+    const HimRegion* r = &job->region;
+    int cs = job->chunk_size;
+
+    int cy = r->y / cs + index;
+    int y0 = cy * cs;
+    int ch = job->height - y0 < cs ? job->height - y0 : cs;
+    int band_y0 = y0 > r->y ? y0 : r->y;
+    int band_y1 = y0 + ch < r->y + r->height ? y0 + ch : r->y + r->height;
+
+    uint8_t* chunk = (uint8_t*)malloc((size_t)cs * (size_t)ch * 4);
+    uint8_t* band = (uint8_t*)malloc((size_t)r->width * (size_t)(band_y1 - band_y0) * 4);
+    int ok = chunk && band;
+
+    for (int cx = r->x / cs; cx <= (r->x + r->width - 1) / cs && ok; cx++)
+    {
+        int x0 = cx * cs;
+        int cw = job->width - x0 < cs ? job->width - x0 : cs;
+        size_t len = (size_t)cw * (size_t)ch * 4;
+
+        const uint8_t* entry = job->table + ((size_t)cy * job->cells_x + cx) * HIM_BLOCK_ENTRY_SIZE;
+        ok = decompress(job->chunks + get_u64(entry), get_u32(entry + 8), chunk, len) == len;
+
+        int ix0 = x0 > r->x ? x0 : r->x;
+        int ix1 = x0 + cw < r->x + r->width ? x0 + cw : r->x + r->width;
+
+        for (int y = band_y0; y < band_y1 && ok; y++)
+            memcpy(band + ((size_t)(y - band_y0) * r->width + (ix0 - r->x)) * 4, chunk + ((size_t)(y - y0) * cw + (ix0 - x0)) * 4, (size_t)(ix1 - ix0) * 4);
+    }
+
+    for (int y = band_y0; y < band_y1 && ok; y++)
+        job->sink->write_span(job->sink->user, 0, y - r->y, r->width, band + (size_t)(y - band_y0) * r->width * 4);
+
+    free(chunk);
+    free(band);
+    job->ok[index] = ok;
+}
+
+// Decodes only the chunks under region; spans are relative to the region.
+static int load_chunks(const uint8_t* payload, size_t payload_len, HexRowParser* parser, const HimRegion* region)
+{
+    uint32_t count;
+    uint32_t chunk_size;
+    const uint8_t* table;
+    const uint8_t* chunks;
+
+    if (!read_block_table(payload, payload_len, &count, &chunk_size, &table, &chunks))
+        return 0;
+
+    if (chunk_size == 0 || chunk_size % HIM_BLOCK_ROWS != 0 || chunk_size > HIM_CHUNK_SIZE_MAX)
+        return 0;
+
+    int cs = (int)chunk_size;
+    int cells_x = (parser->width + cs - 1) / cs;
+    int cells_y = (parser->height + cs - 1) / cs;
+    if (count != (uint32_t)cells_x * (uint32_t)cells_y)
+        return 0;
+
+    int bands = (region->y + region->height - 1) / cs - region->y / cs + 1;
+    int* band_ok = (int*)calloc((size_t)bands, sizeof(int));
+    if (!band_ok)
+        return 0;
+
+    ChunkLoadJob job;
+    job.sink = parser->sink;
+    job.width = parser->width;
+    job.height = parser->height;
+    job.chunk_size = cs;
+    job.cells_x = cells_x;
+    job.region = *region;
+    job.table = table;
+    job.chunks = chunks;
+    job.ok = band_ok;
+
+    parallel_for(bands, 0, decompress_chunk_band, &job);
+
+    int ok = 1;
+    for (int i = 0; i < bands; i++)
+        ok = ok && band_ok[i];
+
+    // the bands covered every row of the region
+    if (ok)
+        parser->y = parser->height;
+
+    free(band_ok);
+    return ok;
+}
+
+static int load_pixel_codec(const uint8_t* payload, size_t payload_len, HexRowParser* parser)
+{
+    PixelDecoder dec;
+    if (!pixel_decoder_init(&dec, parser->width, payload, payload_len))
+        return 0;
+
+    int ok = 1;
+    for (; parser->y < parser->height && ok; parser->y++)
+    {
+        ok = pixel_decode_row(&dec, parser->row);
+        if (ok)
+            parser->sink->write_span(parser->sink->user, 0, parser->y, parser->width, parser->row);
+    }
+
+    pixel_decoder_free(&dec);
+    return ok;
+}
+
+static int load_indexed(const uint8_t* payload, size_t payload_len, HexRowParser* parser)
+{
+    if (payload_len < 3)
+        return 0;
+
+    int count = payload[0] | (payload[1] << 8);
+    size_t head_len = 2 + (size_t)count * 4 + 1;
+    int bits = head_len <= payload_len ? payload[head_len - 1] : 0;
+
+    if (count < 1 || count > PIXEL_PALETTE_MAX || (bits != 1 && bits != 2 && bits != 4 && bits != 8) || count > (1 << bits))
+        return 0;
+
+    size_t row_len = pixel_packed_row_size(parser->width, bits);
+    size_t plane_len = row_len * (size_t)parser->height;
+    uint8_t* plane = (uint8_t*)malloc(plane_len ? plane_len : 1);
+    PixelExpander* ex = (PixelExpander*)malloc(sizeof(PixelExpander));
+
+    int ok = plane && ex && decompress(payload + head_len, payload_len - head_len, plane, plane_len) == plane_len;
+
+    if (ok)
+    {
+        pixel_expander_init(ex, payload + 2, count, bits);
+        for (; parser->y < parser->height; parser->y++)
+        {
+            pixel_expand_row(ex, plane + (size_t)parser->y * row_len, parser->width, parser->row);
+            parser->sink->write_span(parser->sink->user, 0, parser->y, parser->width, parser->row);
+        }
+    }
+
+    free(plane);
+    free(ex);
+    return ok;
+}
+
+static int load_tiles(const uint8_t* payload, size_t payload_len, HexRowParser* parser)
+{
+    if (payload_len < 4)
+        return 0;
+
+    int cells_x = (parser->width + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE;
+    int cells_y = (parser->height + PIXEL_TILE_SIZE - 1) / PIXEL_TILE_SIZE;
+    size_t cells = (size_t)cells_x * (size_t)cells_y;
+    uint32_t count = get_u32(payload);
+
+    if (count < 1 || count > cells)
+        return 0;
+
+    size_t index_size = tile_index_size((int)count);
+    size_t map_len = cells * index_size;
+    size_t plane_len = map_len + (size_t)count * PIXEL_TILE_BYTES;
+    uint8_t* plane = (uint8_t*)malloc(plane_len);
+
+    int ok = plane && decompress(payload + 4, payload_len - 4, plane, plane_len) == plane_len;
+
+    const uint8_t* tiles = ok ? plane + map_len : NULL;
+    for (int cy = 0; cy < cells_y && ok; cy++)
+    {
+        // a band of tile rows, expanded by copying one tile row per cell
+        int rows = parser->height - parser->y;
+        if (rows > PIXEL_TILE_SIZE)
+            rows = PIXEL_TILE_SIZE;
+
+        for (int r = 0; r < rows && ok; r++)
+        {
+            for (int cx = 0; cx < cells_x; cx++)
+            {
+                size_t cell = (size_t)cy * cells_x + cx;
+                uint32_t index = index_size == 2 ? (uint32_t)(plane[cell * 2] | (plane[cell * 2 + 1] << 8)) : get_u32(plane + cell * 4);
+                if (index >= count)
+                {
+                    ok = 0;
+                    break;
+                }
+
+                int x = cx * PIXEL_TILE_SIZE;
+                int n = parser->width - x < PIXEL_TILE_SIZE ? parser->width - x : PIXEL_TILE_SIZE;
+                memcpy(parser->row + (size_t)x * 4, tiles + (size_t)index * PIXEL_TILE_BYTES + r * PIXEL_TILE_SIZE * 4, (size_t)n * 4);
+            }
+
+            if (ok)
+            {
+                parser->sink->write_span(parser->sink->user, 0, parser->y, parser->width, parser->row);
+                parser->y++;
+            }
+        }
+    }
+
+    free(plane);
+    return ok;
+}
+
+static int load_ascii_lz(const uint8_t* payload, size_t payload_len, HexRowParser* parser)
+{
+    // the tokens are decoded straight into the hex parser, the text never exists in full
+    return decompress_string_stream((const char*)payload, payload_len, hex_parser_feed, parser) != COMPRESS_ERROR;
+}
+
+static int load_hex(const uint8_t* payload, size_t payload_len, HexRowParser* parser)
+{
+    return hex_parser_feed(parser, payload, payload_len);
+}
+
+// Raw rows are addressable, so only the region's rows are touched.
+static int load_raw(const uint8_t* payload, size_t payload_len, HexRowParser* parser, const HimRegion* region)
+{
+    const HimSink* sink = parser->sink;
+    size_t row_len = (size_t)parser->width * 4;
+    size_t span_len = (size_t)region->width * 4;
+
+    if (payload_len != row_len * (size_t)parser->height)
+        return 0;
+
+    const uint8_t* first = payload + (size_t)region->y * row_len + (size_t)region->x * 4;
+
+    // the payload is the canvas byte for byte when the sink can hand it over
+    uint8_t* canvas = sink->pixels ? sink->pixels(sink->user) : NULL;
+    if (canvas && span_len == row_len)
+    {
+        memcpy(canvas, first, span_len * (size_t)region->height);
+    }
+    else
+    {
+        for (int y = 0; y < region->height; y++)
+        {
+            if (canvas)
+                memcpy(canvas + (size_t)y * span_len, first + (size_t)y * row_len, span_len);
+            else
+                sink->write_span(sink->user, 0, y, region->width, first + (size_t)y * row_len);
+        }
+    }
+
+    parser->y = parser->height;
+    return 1;
+}
+
+// Maps the file copy-on-write, or reads it into the heap where it cannot be
+// mapped (empty files, or a platform refusing the mapping).
+static int map_file(const char* filename, HimMapping* map)
+{
+    memset(map, 0, sizeof(*map));
+
+    // from the OS rather than ftell, whose long is 32 bits on Windows
+    uint64_t file_size = 0;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        return 0;
+    }
+    file_size = (uint64_t)size.QuadPart;
+
+    if (file_size > 0 && file_size <= SIZE_MAX)
+    {
+        // the view keeps the mapping alive once both handles are closed
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping)
+        {
+            map->data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            map->size = (size_t)file_size;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    file_size = (uint64_t)st.st_size;
+
+    if (file_size > 0 && file_size <= SIZE_MAX)
+    {
+        void* p = mmap(NULL, (size_t)file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            map->data = (uint8_t*)p;
+            map->size = (size_t)file_size;
+        }
+    }
+    close(fd);
+#endif
+
+    if (map->data)
+    {
+        map->mapped = 1;
+        return 1;
+    }
+
+    if (file_size > SIZE_MAX)
+        return 0;
+
+    FILE* fin = fopen(filename, "rb");
+    if (!fin)
+        return 0;
+
+    map->size = (size_t)file_size;
+    map->data = (uint8_t*)malloc(map->size ? map->size : 1);
+    int ok = map->data && fread(map->data, 1, map->size, fin) == map->size;
+    fclose(fin);
+
+    if (!ok)
+    {
+        free(map->data);
+        map->data = NULL;
+    }
+    return ok;
+}
+
+static void unmap_file(HimMapping* map)
+{
+    if (map->mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(map->data);
+#else
+        munmap(map->data, map->size);
+#endif
+    }
+    else
+    {
+        free(map->data);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+typedef struct
+{
+    int width;
+    int height;
+    int format;
+    const uint8_t* payload;
+    size_t payload_len;
+} HimHeader;
+
+static int read_header(const HimMapping* map, const char* filename, HimHeader* h)
+{
+    const uint8_t* data = map->data;
+    memset(h, 0, sizeof(*h));
+
+    if (map->size >= 4 && memcmp(data, HIM_MAGIC, 4) == 0)
+    {
+        if (map->size < HIM_HEADER_SIZE)
+        {
+            printf("load_pixels: bad header '%s'\n", filename);
+            return 0;
+        }
+
+        int version = get_u16(data + 4);
+        uint16_t header_len = get_u16(data + 6);
+        uint32_t w = get_u32(data + 8);
+        uint32_t ht = get_u32(data + 12);
+        uint64_t raw_len = get_u64(data + 20);
+        uint64_t payload_len = get_u64(data + 28);
+
+        if (version > HIM_VERSION)
+        {
+            printf("load_pixels: '%s' is version %d, this build reads up to %d\n", filename, version, HIM_VERSION);
+            return 0;
+        }
+
+        if (header_len < HIM_HEADER_SIZE || w == 0 || ht == 0 || w > INT_MAX || ht > INT_MAX || raw_len != (uint64_t)w * ht * 4)
+        {
+            printf("load_pixels: bad header '%s'\n", filename);
+            return 0;
+        }
+
+        if (header_len > map->size || payload_len > map->size - header_len)
+        {
+            printf("load_pixels: truncated data '%s'\n", filename);
+            return 0;
+        }
+
+        if (data[16] != HIM_PIXEL_RGBA8)
+        {
+            printf("load_pixels: unknown pixel format %d in '%s'\n", data[16], filename);
+            return 0;
+        }
+
+        h->width = (int)w;
+        h->height = (int)ht;
+        h->format = data[17];
+        h->payload = data + header_len;
+        h->payload_len = (size_t)payload_len;
+
+        if (h->format < HIM_FORMAT_LZ || h->format > HIM_FORMAT_CHUNKS || (h->format == HIM_FORMAT_RAW && payload_len != raw_len))
+        {
+            printf("load_pixels: unknown format %d in '%s'\n", h->format, filename);
+            return 0;
+        }
+        return 1;
+    }
+
+    // a text header from before HIM_VERSION 2, read like fgets into 64 bytes
+    char text[64];
+    size_t line = 0;
+    while (line < sizeof(text) - 1 && line < map->size)
+    {
+        text[line] = (char)data[line];
+        if (data[line++] == '\n')
+            break;
+    }
+    text[line] = '\0';
+
+    int format;
+    int fields = sscanf(text, "%d %d %d", &h->width, &h->height, &format);
+    if (fields < 2 || h->width <= 0 || h->height <= 0)
+    {
+        printf("load_pixels: bad header '%s'\n", filename);
+        return 0;
+    }
+
+    // no build ever wrote a format number into a text header
+    if (fields > 2)
+    {
+        printf("load_pixels: unknown format %d in '%s'\n", format, filename);
+        return 0;
+    }
+
+    h->payload = data + line;
+    h->payload_len = map->size - line;
+
+    // plain hex starts with "0x", ASCII-LZ with the bits of its first '0'
+    size_t i = 0;
+    while (i < h->payload_len && (h->payload[i] == ' ' || h->payload[i] == '\n' || h->payload[i] == '\r' || h->payload[i] == '\t'))
+        i++;
+
+    if (h->payload_len - i >= 2 && h->payload[i] == '0' && (h->payload[i + 1] == 'x' || h->payload[i + 1] == 'X'))
+        h->format = HIM_FORMAT_HEX;
+    else
+        h->format = HIM_FORMAT_ASCII_LZ;
+
+    return 1;
+}
+
+// Crops a full decode to a region, for formats without random access.
+typedef struct
+{
+    const HimSink* sink;
+    HimRegion region;
+} RegionSink;
+
+static int region_begin(void* user, int width, int height)
+{
+    RegionSink* rs = (RegionSink*)user;
+    (void)width;
+    (void)height;
+    return rs->sink->begin(rs->sink->user, rs->region.width, rs->region.height);
+}
+
+static void region_write_span(void* user, int x, int y, int count, const uint8_t* rgba)
+{
+    RegionSink* rs = (RegionSink*)user;
+    const HimRegion* r = &rs->region;
+
+    if (y < r->y || y >= r->y + r->height)
+        return;
+
+    int x0 = x > r->x ? x : r->x;
+    int x1 = x + count < r->x + r->width ? x + count : r->x + r->width;
+    if (x0 < x1)
+        rs->sink->write_span(rs->sink->user, x0 - r->x, y - r->y, x1 - x0, rgba + (size_t)(x0 - x) * 4);
+}
+
+// region NULL loads the whole image
+static int load_mapped(const HimHeader* h, const HimRegion* region, const HimSink* sink, const char* filename)
+{
+    HimRegion whole = { 0, 0, h->width, h->height };
+    if (!region)
+        region = &whole;
+
+    if (region->x < 0 || region->y < 0 || region->width <= 0 || region->height <= 0 || region->x > h->width - region->width || region->y > h->height - region->height)
+    {
+        printf("load_pixels: region %d,%d %dx%d is outside '%s' (%dx%d)\n", region->x, region->y, region->width, region->height, filename, h->width, h->height);
+        return 0;
+    }
+
+    // chunked and raw files decode the region alone, the rest decode everything and crop
+    int direct = h->format == HIM_FORMAT_CHUNKS || h->format == HIM_FORMAT_RAW;
+    int cropped = !direct && memcmp(region, &whole, sizeof(whole)) != 0;
+
+    RegionSink crop = { sink, *region };
+    HimSink crop_sink = { &crop, region_begin, region_write_span, NULL };
+
+    HexRowParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.sink = cropped ? &crop_sink : sink;
+    parser.width = h->width;
+    parser.height = h->height;
+    parser.row = (uint8_t*)malloc((size_t)h->width * 4);
+
+    if (!parser.row || !parser.sink->begin(parser.sink->user, direct ? region->width : h->width, direct ? region->height : h->height))
+    {
+        printf("load_pixels: failed to allocate memory\n");
+        free(parser.row);
+        return 0;
+    }
+
+    int ok;
+    if (h->format == HIM_FORMAT_LZ)
+        ok = load_lz_stream(h->payload, h->payload_len, &parser);
+    else if (h->format == HIM_FORMAT_LZ_BLOCKS)
+        ok = load_lz_blocks(h->payload, h->payload_len, &parser, filename);
+    else if (h->format == HIM_FORMAT_PIXELS)
+        ok = load_pixel_codec(h->payload, h->payload_len, &parser);
+    else if (h->format == HIM_FORMAT_INDEXED)
+        ok = load_indexed(h->payload, h->payload_len, &parser);
+    else if (h->format == HIM_FORMAT_TILES)
+        ok = load_tiles(h->payload, h->payload_len, &parser);
+    else if (h->format == HIM_FORMAT_RAW)
+        ok = load_raw(h->payload, h->payload_len, &parser, region);
+    else if (h->format == HIM_FORMAT_CHUNKS)
+        ok = load_chunks(h->payload, h->payload_len, &parser, region);
+    else if (h->format == HIM_FORMAT_HEX)
+        ok = load_hex(h->payload, h->payload_len, &parser);
+    else
+        ok = load_ascii_lz(h->payload, h->payload_len, &parser);
+
+    if (!ok)
+        printf("load_pixels: corrupt data '%s'\n", filename);
+
+    ok = ok && hex_parser_finish(&parser, filename);
+    free(parser.row);
+    return ok;
+}
+
+int him_load(const char* filename, const HimSink* sink)
+{
+    return him_load_region(filename, NULL, sink);
+}
+
+int him_load_region(const char* filename, const HimRegion* region, const HimSink* sink)
+{
+    HimMapping map;
+    if (!map_file(filename, &map))
+    {
+        printf("load_pixels: failed to open '%s'\n", filename);
+        return 0;
+    }
+
+    HimHeader h;
+    int ok = read_header(&map, filename, &h) && load_mapped(&h, region, sink, filename);
+    unmap_file(&map);
+
+    if (ok && region)
+        printf("load_pixels: loaded '%s' (%dx%d at %d,%d)\n", filename, region->width, region->height, region->x, region->y);
+    else if (ok)
+        printf("load_pixels: loaded '%s' (%dx%d)\n", filename, h.width, h.height);
+
+    return ok;
+}
+
+int him_info(const char* filename, int* width, int* height, int* format)
+{
+    HimMapping map;
+    if (!map_file(filename, &map))
+    {
+        printf("load_pixels: failed to open '%s'\n", filename);
+        return 0;
+    }
+
+    HimHeader h;
+    int ok = read_header(&map, filename, &h);
+    unmap_file(&map);
+
+    if (ok)
+    {
+        *width = h.width;
+        *height = h.height;
+        *format = h.format;
+    }
+    return ok;
+}
+
+static int pixels_begin(void* user, int width, int height)
+{
+    HimPixels* image = (HimPixels*)user;
+    image->pixels = (uint8_t*)malloc((size_t)width * (size_t)height * 4);
+    image->width = width;
+    image->height = height;
+    return image->pixels != NULL;
+}
+
+static void pixels_write_span(void* user, int x, int y, int count, const uint8_t* rgba)
+{
+    HimPixels* image = (HimPixels*)user;
+    memcpy(image->pixels + ((size_t)y * image->width + x) * 4, rgba, (size_t)count * 4);
+}
+
+static uint8_t* pixels_canvas(void* user)
+{
+    return ((HimPixels*)user)->pixels;
+}
+
+int him_open_pixels(const char* filename, HimPixels* image)
+{
+    return him_open_region(filename, NULL, image);
+}
+
+int him_open_region(const char* filename, const HimRegion* region, HimPixels* image)
+{
+    memset(image, 0, sizeof(*image));
+
+    HimMapping map;
+    if (!map_file(filename, &map))
+    {
+        printf("load_pixels: failed to open '%s'\n", filename);
+        return 0;
+    }
+
+    HimHeader h;
+    int ok = read_header(&map, filename, &h);
+
+    // raw pixels stay in the mapping; private pages mean writes never reach the file
+    if (ok && h.format == HIM_FORMAT_RAW && !region)
+    {
+        image->width = h.width;
+        image->height = h.height;
+        image->pixels = (uint8_t*)h.payload;
+        image->map = map;
+        return 1;
+    }
+
+    HimSink sink = { image, pixels_begin, pixels_write_span, pixels_canvas };
+    ok = ok && load_mapped(&h, region, &sink, filename);
+    unmap_file(&map);
+
+    if (!ok)
+        him_close_pixels(image);
+    return ok;
+}
+
+void him_close_pixels(HimPixels* image)
+{
+    if (image->map.data)
+        unmap_file(&image->map);
+    else
+        free(image->pixels);
+    memset(image, 0, sizeof(*image));
+}
+
+static const LZDict* registered_dicts[HIM_MAX_DICTS];
+static int registered_dict_count = 0;
+
+int him_register_dict(const LZDict* dict)
+{
+    for (int i = 0; i < registered_dict_count; i++)
+    {
+        if (registered_dicts[i]->id == dict->id)
+        {
+            registered_dicts[i] = dict;
+            return 1;
+        }
+    }
+
+    if (registered_dict_count == HIM_MAX_DICTS)
+        return 0;
+
+    registered_dicts[registered_dict_count++] = dict;
+    return 1;
+}
+
+const LZDict* him_find_dict(uint32_t id)
+{
+    for (int i = 0; i < registered_dict_count; i++)
+    {
+        if (registered_dicts[i]->id == id)
+            return registered_dicts[i];
+    }
+    return NULL;
+}
+
+// Collects the hex text of every loaded file back to back, one sample per file.
+typedef struct
+{
+    char* text;
+    size_t len;
+    size_t cap;
+    size_t sample_start;
+    int width;
+} DictSamples;
+
+static int dict_samples_begin(void* user, int width, int height)
+{
+    DictSamples* ds = (DictSamples*)user;
+    size_t need = ds->len + hex_text_size(width, height);
+
+    if (need > ds->cap)
+    {
+        size_t cap = ds->cap ? ds->cap : MB(1);
+        while (cap < need)
+            cap *= 2;
+
+        char* text = (char*)realloc(ds->text, cap);
+        if (!text)
+            return 0;
+        ds->text = text;
+        ds->cap = cap;
+    }
+
+    ds->sample_start = ds->len;
+    ds->width = width;
+    ds->len = need;
+    return 1;
+}
+
+static void dict_samples_write_span(void* user, int x, int y, int count, const uint8_t* rgba)
+{
+    DictSamples* ds = (DictSamples*)user;
+    (void)x;
+
+    size_t row_text_len = (size_t)ds->width * HEX_TOKEN_LEN + 1;
+    format_hex_row(rgba, count, ds->text + ds->sample_start + (size_t)y * row_text_len);
+}
+
+int him_dict_train(const char* const* filenames, int count, size_t dict_size, LZDict* dict)
+{
+    DictSamples ds;
+    memset(&ds, 0, sizeof(ds));
+    HimSink sink = { &ds, dict_samples_begin, dict_samples_write_span, NULL };
+
+    size_t* sizes = (size_t*)malloc((size_t)(count > 0 ? count : 1) * sizeof(size_t));
+    uint8_t* data = (uint8_t*)malloc(dict_size ? dict_size : 1);
+    int samples = 0;
+
+    for (int i = 0; i < count && sizes && data; i++)
+    {
+        size_t before = ds.len;
+        if (him_load(filenames[i], &sink))
+            sizes[samples++] = ds.len - before;
+        else
+            ds.len = before;
+    }
+
+    size_t size = 0;
+    if (samples > 0)
+        size = lz_dict_train((const uint8_t*)ds.text, sizes, samples, data, dict_size);
+
+    free(ds.text);
+    free(sizes);
+
+    if (size == 0)
+    {
+        printf("dict: nothing to train on\n");
+        free(data);
+        return 0;
+    }
+
+    lz_dict_init(dict, data, size);
+    printf("dict: trained %zu bytes from %d files, id %08X\n", size, samples, dict->id);
+    return 1;
+}
+
+int him_dict_save(const char* filename, const LZDict* dict)
+{
+    FILE* fout = fopen(filename, "wb");
+    if (!fout)
+    {
+        printf("dict: failed to open '%s'\n", filename);
+        return 0;
+    }
+
+    uint8_t head[12];
+    memcpy(head, HIM_DICT_MAGIC, 4);
+    put_u32(head + 4, dict->id);
+    put_u32(head + 8, (uint32_t)dict->size);
+
+    int ok = fwrite(head, 1, sizeof(head), fout) == sizeof(head) && fwrite(dict->data, 1, dict->size, fout) == dict->size;
+    fclose(fout);
+
+    if (!ok)
+        printf("dict: write failed '%s'\n", filename);
+    return ok;
+}
+
+int him_dict_load(const char* filename, LZDict* dict)
+{
+    FILE* fin = fopen(filename, "rb");
+    if (!fin)
+    {
+        printf("dict: failed to open '%s'\n", filename);
+        return 0;
+    }
+
+    uint8_t head[12];
+    uint8_t* data = NULL;
+    size_t size = 0;
+    int ok = fread(head, 1, sizeof(head), fin) == sizeof(head) && memcmp(head, HIM_DICT_MAGIC, 4) == 0;
+
+    if (ok)
+    {
+        size = get_u32(head + 8);
+        data = size <= LZ_DICT_MAX_SIZE ? (uint8_t*)malloc(size ? size : 1) : NULL;
+        ok = data && fread(data, 1, size, fin) == size;
+    }
+    fclose(fin);
+
+    // the ID is a hash of the contents, so this also catches damaged files
+    if (ok)
+    {
+        lz_dict_init(dict, data, size);
+        ok = dict->id == get_u32(head + 4);
+    }
+
+    if (!ok)
+    {
+        printf("dict: bad dictionary file '%s'\n", filename);
+        free(data);
+        return 0;
+    }
+    return 1;
+}
+
+void him_dict_free(LZDict* dict)
+{
+    free((void*)dict->data);
+    dict->data = NULL;
+    dict->size = 0;
+}
@@ -6,52 +6,13 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+#include "him_file.h"
+
 typedef struct {
     uint8_t r, g, b, a;
 } Color4;
 
 
-static Color4* load_him(const char* path, int* w, int* h)
-{
-    FILE* f = fopen(path, "r");
-    if (!f) return NULL;
-
-    if (fscanf(f, "%d %d", w, h) != 2) {
-        fclose(f);
-        return NULL;
-    }
-
-    Color4* pixels = malloc((*w) * (*h) * sizeof(Color4));
-    if (!pixels) {
-        fclose(f);
-        return NULL;
-    }
-
-    char buf[11];
-    for (int y = 0; y < *h; y++) {
-        for (int x = 0; x < *w; x++) {
-            if (fscanf(f, "%10s", buf) != 1) {
-                free(pixels);
-                fclose(f);
-                return NULL;
-            }
-
-            uint32_t hex = (uint32_t)strtoul(buf, NULL, 0);
-            Color4 c = {
-                .r = (hex >> 24) & 0xFF,
-                .g = (hex >> 16) & 0xFF,
-                .b = (hex >> 8)  & 0xFF,
-                .a =  hex        & 0xFF
-            };
-
-            pixels[y * (*w) + x] = c;
-        }
-    }
-
-    fclose(f);
-    return pixels;
-}
-
 static Color4* scale_image(Color4* src, int sw, int sh, int dw, int dh)
 {
     Color4* dst = malloc(dw * dh * sizeof(Color4));
@@ -76,11 +37,25 @@ int main(int argc, char** argv)
     const char* output = argv[2];
     int thumb_size     = atoi(argv[3]);
 
-    int w, h;
-    Color4* pixels = load_him(input, &w, &h);
-    if (!pixels)
+    // optional x y w h: thumbnail just that part, chunked files only decode it
+    HimRegion region;
+    int has_region = argc >= 8;
+    if (has_region) {
+        region.x      = atoi(argv[4]);
+        region.y      = atoi(argv[5]);
+        region.width  = atoi(argv[6]);
+        region.height = atoi(argv[7]);
+    }
+
+    // raw files are used straight from the page cache, nothing is copied
+    HimPixels image;
+    if (!him_open_region(input, has_region ? &region : NULL, &image))
         return 1;
 
+    Color4* pixels = (Color4*)image.pixels;
+    int w = image.width;
+    int h = image.height;
+
     int tw = thumb_size;
     int th = thumb_size;
 
@@ -90,7 +65,7 @@ int main(int argc, char** argv)
         tw = (w * thumb_size) / h;
 
     Color4* thumb = scale_image(pixels, w, h, tw, th);
-    free(pixels);
+    him_close_pixels(&image);
 
     if (!thumb)
         return 1;
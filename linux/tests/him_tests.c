@@ -0,0 +1,265 @@
+// Regression tests for the compressor and the .him file code: corrupt and
+// edge-case input that once broke them. Run by make test, which the
+// default build runs too.
+//
+//   bin/him_tests
+//
+// Prints one line per test and exits with 1 when any fails.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Allocations are counted by routing the compressor's through here, so the
+// compressor is built into this file rather than linked; him_file.c and
+// pixel_codec.c are linked as usual.
+static void* test_malloc(size_t size);
+static void* test_calloc(size_t count, size_t size);
+
+#define LZ_MALLOC(size) test_malloc(size)
+#define LZ_CALLOC(count, size) test_calloc(count, size)
+#define LZ_FREE(ptr) free(ptr)
+#include "../src/compressor.c"
+#include "pixel_codec.h"
+
+static size_t heap_allocs;
+
+static void* test_malloc(size_t size)
+{
+    heap_allocs++;
+    return malloc(size);
+}
+
+static void* test_calloc(size_t count, size_t size)
+{
+    heap_allocs++;
+    return calloc(count, size);
+}
+
+typedef struct
+{
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+} TestReader;
+
+static size_t test_read(void* user, uint8_t* data, size_t len)
+{
+    TestReader* r = (TestReader*)user;
+    size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+    memcpy(data, r->data + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+static int test_discard(void* user, const uint8_t* data, size_t len)
+{
+    (void)user;
+    (void)data;
+    (void)len;
+    return 1;
+}
+
+static size_t decode_stream(const uint8_t* stream, size_t len)
+{
+    TestReader reader = { stream, len, 0 };
+    LZDecoder d;
+    if (!lz_decoder_init(&d, test_read, &reader))
+        return COMPRESS_ERROR;
+
+    size_t n = lz_decoder_run(&d, test_discard, NULL);
+    lz_decoder_free(&d);
+    return n;
+}
+
+// A 1 KB window stream that fills the decoder's history to one byte short
+// of a slide, then asks for a match reaching back over all of it: the slide
+// in the middle of the match keeps only 1 KB, so the offset must be refused.
+// A window larger than any encoder writes must be refused up front.
+static int test_corrupt_stream(void)
+{
+    const int window_log = 10;
+    size_t literals = ((size_t)1 << window_log) + LZ_DECODE_CHUNK - 1;
+    size_t whole = literals / 8 * 8;
+    uint8_t* stream = (uint8_t*)malloc(1 + literals + literals / 8 + 16);
+    if (!stream)
+        return 0;
+
+    size_t len = 0;
+    stream[len++] = (uint8_t)window_log;
+    for (size_t i = 0; i < whole; i++)
+    {
+        if (i % 8 == 0)
+            stream[len++] = 0;
+        stream[len++] = (uint8_t)i;
+    }
+
+    int rest = (int)(literals - whole);
+    stream[len++] = (uint8_t)(1 << rest);
+    for (int i = 0; i < rest; i++)
+        stream[len++] = 'x';
+    len = write_varint(stream, len, MAX_LZ - MIN_LZ);
+    len = write_varint(stream, len, (uint32_t)literals - 1);
+
+    int ok = decode_stream(stream, len) == COMPRESS_ERROR;
+
+    // the same literals in a window that does keep them all decode fine
+    stream[0] = LZ_STREAM_WINDOW_LOG;
+    ok = ok && decode_stream(stream, len) == literals + MAX_LZ;
+
+    stream[0] = LZ_WINDOW_LOG + 1;
+    ok = ok && decode_stream(stream, len) == COMPRESS_ERROR;
+
+    free(stream);
+    return ok;
+}
+
+// Hex text of a canvas of 16x16 tiles from a few colours, like the .him
+// block format compresses; free with free().
+static uint8_t* tile_text(int side, size_t* len)
+{
+    static const uint8_t colors[4][4] = { { 0, 0, 0, 0 }, { 0x22, 0x8B, 0x22, 0xFF }, { 0x10, 0x10, 0x10, 0xFF }, { 0xF0, 0xD0, 0x60, 0xFF } };
+    size_t row_len = (size_t)side * PIXEL_HEX_TOKEN + 1;
+    uint8_t* row = (uint8_t*)malloc((size_t)side * 4);
+    uint8_t* text = (uint8_t*)malloc(row_len * (size_t)side);
+    if (!row || !text)
+    {
+        free(row);
+        free(text);
+        return NULL;
+    }
+
+    for (int y = 0; y < side; y++)
+    {
+        for (int x = 0; x < side; x++)
+        {
+            int tile = (x / 16 * 7 + y / 16 * 3) % 5;
+            int c = ((x % 16) * (y % 16) + tile) % 4;
+            memcpy(row + x * 4, colors[c], 4);
+        }
+        pixel_hex_encode(row, (size_t)side, text + (size_t)y * row_len);
+        text[(size_t)y * row_len + row_len - 1] = '\n';
+    }
+
+    free(row);
+    *len = row_len * (size_t)side;
+    return text;
+}
+
+// A save compresses its blocks through one LZContext per worker: after the
+// first block, the rest of a run of equal blocks must allocate nothing, at
+// every level and with a dictionary.
+static int test_context_reuse(void)
+{
+    const int blocks = 8;
+    size_t text_len;
+    uint8_t* text = tile_text(128, &text_len);
+
+    size_t block_len = text_len / (size_t)blocks;
+    size_t cap = compress_bound(block_len);
+    uint8_t* out = (uint8_t*)malloc(cap);
+
+    int ok = text && out;
+    LZDict dict;
+    if (ok)
+        lz_dict_init(&dict, text, block_len);
+
+    for (int level = LZ_LEVEL_FAST; level <= LZ_LEVEL_BEST && ok; level++)
+    {
+        for (int with_dict = 0; with_dict < 2 && ok; with_dict++)
+        {
+            LZContext ctx;
+            lz_context_init(&ctx, level, NULL);
+
+            size_t allocs = 0;
+            for (int i = 0; i < blocks && ok; i++)
+            {
+                if (i == 1)
+                    allocs = heap_allocs;
+                ok = lz_context_compress(&ctx, text + (size_t)i * block_len, block_len, out, cap, with_dict ? &dict : NULL) != COMPRESS_ERROR;
+            }
+
+            ok = ok && heap_allocs == allocs;
+            lz_context_free(&ctx);
+        }
+    }
+
+    free(text);
+    free(out);
+    return ok;
+}
+
+// xorshift32, so every run tests the same input
+static uint32_t test_rand(uint32_t* state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Noise takes the literal path for nearly every byte, so the output only
+// fits a compress_bound buffer if the bound covers the dictionary header.
+static int test_incompressible_dict(void)
+{
+    static const size_t sizes[] = { 1, 7, 1000, 65536 + 3 };
+    uint32_t state = 0x2545F491u;
+    uint8_t dict_data[4096];
+    for (size_t i = 0; i < sizeof(dict_data); i++)
+        dict_data[i] = (uint8_t)test_rand(&state);
+
+    LZDict dict;
+    lz_dict_init(&dict, dict_data, sizeof(dict_data));
+
+    int ok = 1;
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])) && ok; s++)
+    {
+        size_t len = sizes[s];
+        size_t cap = compress_bound(len);
+        uint8_t* in = (uint8_t*)malloc(len);
+        uint8_t* out = (uint8_t*)malloc(cap);
+        uint8_t* back = (uint8_t*)malloc(len);
+        ok = in && out && back;
+
+        for (size_t i = 0; ok && i < len; i++)
+            in[i] = (uint8_t)test_rand(&state);
+
+        for (int level = LZ_LEVEL_FAST; level <= LZ_LEVEL_BEST && ok; level++)
+        {
+            size_t n = compress_dict(in, len, out, cap, level, &dict);
+            ok = n != COMPRESS_ERROR && decompress_dict(out, n, back, len, &dict) == len && memcmp(back, in, len) == 0;
+        }
+
+        free(in);
+        free(out);
+        free(back);
+    }
+    return ok;
+}
+
+int main(void)
+{
+    static const struct
+    {
+        const char* name;
+        int (*run)(void);
+    } tests[] =
+    {
+        { "corrupt stream", test_corrupt_stream },
+        { "no allocations after first block", test_context_reuse },
+        { "incompressible input, dictionary", test_incompressible_dict },
+    };
+
+    int failures = 0;
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++)
+    {
+        int ok = tests[i].run();
+        failures += !ok;
+        printf("%-40s %s\n", tests[i].name, ok ? "ok" : "FAIL");
+    }
+
+    printf("%d of %d tests failed\n", failures, (int)(sizeof(tests) / sizeof(tests[0])));
+    return failures ? 1 : 0;
+}